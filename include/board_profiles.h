@@ -0,0 +1,194 @@
+#ifndef BOARD_PROFILES_H
+#define BOARD_PROFILES_H
+
+#include <stdint.h>
+
+/** Board profiles
+ * Everything that depends on which board we are flashing lives here rather
+ * than in scattered #defines: pins, timers, prescalers and buffer sizes.
+ *
+ * A profile is picked by a build flag set per environment in platformio.ini:
+ *   * BOARD_PROFILE_DEVKIT_V1    -> [env:esp32doit-devkit-v1]
+ *   * BOARD_PROFILE_NODEMCU_32S  -> [env:nodemcu-32s]
+ *   * BOARD_PROFILE_NATIVE       -> [env:native] (host simulation, no pins)
+ *
+ * The selected profile is 'BOARD'. All the numbers we derive from it (timer
+ * tick length, max measurable RPM, LEDC limits) are worked out at compile
+ * time and checked with static_assert, so a bad profile fails the build
+ * rather than the strobe.
+ **/
+
+// A 'struct' describing one board. Fields are grouped as the hardware is.
+struct BoardProfile {
+  const char *name;
+  // LED/strobe output
+  uint8_t  ledPin;
+  uint8_t  ledOnboardPin;
+  uint8_t  ledPwmChannel;       // LEDC channel 0 to 15
+  uint8_t  ledPwmResolution;    // LEDC resolution in bits
+  uint32_t ledPwmInitialDuty;
+  uint32_t ledPwmInitialFreq;   // Frequency used by ledcSetup() before we measure anything
+  // Rotation sensor input
+  uint8_t  freqMeasurePin;
+  uint8_t  freqMeasureTimer;    // Hardware timer 0 to 3
+  uint32_t freqMeasureTimerPrescaler;
+  uint8_t  pulsesPerRevolution; // Falling edges per motor revolution (magnets)
+  uint32_t minPeriodTicks;      // Shortest period we accept, sets measurement resolution
+  uint32_t motorMaxRpm;         // Fastest the motor is expected to spin
+  uint32_t motorMinRpm;         // Slowest the strobe still has to follow
+  double   gearingFactor;       // Motor to zoetrope rotation, the default for 'r'
+  // Control (quarter second) tick, run from esp_timer
+  uint32_t controlTicksPerSecond;
+  // Clocks. The ESP32 timers and LEDC run from APB, not F_CPU. LEDC falls
+  // back to the slower REF_TICK clock for frequencies APB can't divide down to
+  uint32_t apbClockHz;
+  uint32_t refTickHz;
+  // Buffers, must be powers of two
+  uint16_t freqSampleNum;
+  uint16_t statsWindowSize;     // Edges in the rotation statistics percentile window
+  uint8_t  statsHistogramBins;  // RPM histogram bins spread over 0 to motorMaxRpm
+  uint8_t  schedulerQueueSize;  // Pending time triggered commands
+  // Serial
+  uint32_t serialBaud;
+};
+
+/** The ESP32 boards we use only differ in their pins
+ * Everything else is the same for all of them, so it is written once here
+ * and a new field only needs adding in one place. A board that really is
+ * different can still be written out in full.
+ **/
+constexpr BoardProfile esp32Profile(const char *name, uint8_t ledPin, uint8_t ledOnboardPin, uint8_t freqMeasurePin) {
+  return BoardProfile{
+    name,
+    ledPin,
+    ledOnboardPin,
+    0,          // ledPwmChannel
+    10,         // ledPwmResolution, what ledcWriteTone() used, down to ~0.95Hz
+    32,         // ledPwmInitialDuty, 3.1%
+    500,        // ledPwmInitialFreq
+    freqMeasurePin,
+    1,          // freqMeasureTimer
+    80,         // freqMeasureTimerPrescaler, 80MHz / 80 = 1MHz ie 1us ticks
+    1,          // pulsesPerRevolution
+    1000,       // minPeriodTicks, 0.1% resolution
+    3000,       // motorMaxRpm
+    250,        // motorMinRpm
+    0.26,       // gearingFactor
+    4,          // controlTicksPerSecond
+    80000000,   // apbClockHz
+    1000000,    // refTickHz
+    64,         // freqSampleNum
+    256,        // statsWindowSize
+    60,         // statsHistogramBins, 50 RPM wide
+    16,         // schedulerQueueSize
+    115200      // serialBaud
+  };
+}
+
+// name, ledPin, ledOnboardPin, freqMeasurePin
+constexpr BoardProfile PROFILE_DEVKIT_V1 = esp32Profile("esp32doit-devkit-v1", 23, 2, 19);
+constexpr BoardProfile PROFILE_NODEMCU_32S = esp32Profile("nodemcu-32s", 12, 2, 19);
+// Host simulation. Pins are meaningless, clocks match the ESP32 so the
+// derived numbers are the same as on hardware.
+constexpr BoardProfile PROFILE_NATIVE = esp32Profile("native", 0, 0, 0);
+
+#if defined(BOARD_PROFILE_NODEMCU_32S)
+constexpr BoardProfile BOARD = PROFILE_NODEMCU_32S;
+#elif defined(BOARD_PROFILE_NATIVE)
+constexpr BoardProfile BOARD = PROFILE_NATIVE;
+#elif defined(BOARD_PROFILE_DEVKIT_V1)
+constexpr BoardProfile BOARD = PROFILE_DEVKIT_V1;
+#else
+#error "No board profile selected, add -DBOARD_PROFILE_<name> to build_flags in platformio.ini"
+#endif
+
+/** Derived values
+ * These are functions of a profile so they can be checked for every profile,
+ * not just the one we are building. Single return statements keep them
+ * valid C++11 constexpr.
+ **/
+constexpr bool isPowerOfTwo(uint32_t value) {
+  return value != 0 && (value & (value - 1)) == 0;
+}
+
+// Length of one frequency measure timer tick in seconds. Note the timers are
+// clocked from APB (80MHz), using F_CPU here is wrong and integer division
+// truncates it to 0 anyway.
+constexpr double timerTickSeconds(const BoardProfile &board) {
+  return (double)board.freqMeasureTimerPrescaler / board.apbClockHz;
+}
+
+// Fastest rotation we can measure to 'minPeriodTicks' resolution
+constexpr double maxMeasurableRpm(const BoardProfile &board) {
+  return 60.0 / (board.minPeriodTicks * timerTickSeconds(board) * board.pulsesPerRevolution);
+}
+
+// LEDC counts to 2^resolution each PWM period. Its clock divider is 18 bits
+// with 8 of them fractional, so it divides by 1 to just under 1024.
+// The fastest is APB undivided. Below APB / (2^resolution * 1024) the core
+// switches the timer to REF_TICK, so the slowest is REF_TICK fully divided.
+#define LEDC_DIVIDER_MAX              (((1UL << 18) - 1) / 256.0)
+constexpr double ledcMaxFreqHz(const BoardProfile &board) {
+  return (double)board.apbClockHz / (1UL << board.ledPwmResolution);
+}
+constexpr double ledcMinFreqHz(const BoardProfile &board) {
+  return board.refTickHz / (1UL << board.ledPwmResolution) / LEDC_DIVIDER_MAX;
+}
+
+// Strobe frequency for the motor at 'rpm', with no 'freqDelta' applied
+constexpr double strobeFreqHz(const BoardProfile &board, double rpm) {
+  return rpm / 60.0 * board.pulsesPerRevolution * board.gearingFactor;
+}
+
+constexpr bool isValidProfile(const BoardProfile &board) {
+  return
+    // ESP32 has 4 hardware timers, with a 16 bit prescaler of at least 2.
+    // The hardware can divide by 65536 but timerBegin() takes a uint16_t
+    board.freqMeasureTimer < 4 &&
+    board.freqMeasureTimerPrescaler >= 2 && board.freqMeasureTimerPrescaler <= 65535 &&
+    // A whole number of timer ticks per second, or the period maths drifts
+    (board.apbClockHz % board.freqMeasureTimerPrescaler) == 0 &&
+    // and of microseconds per control tick, or the esp_timer control tick does
+    1000000UL % board.controlTicksPerSecond == 0 &&
+    // LEDC
+    board.ledPwmChannel < 16 &&
+    board.ledPwmResolution >= 1 && board.ledPwmResolution <= 20 &&
+    board.ledPwmInitialDuty < (1UL << board.ledPwmResolution) &&
+    board.ledPwmInitialFreq >= ledcMinFreqHz(board) &&
+    board.ledPwmInitialFreq <= ledcMaxFreqHz(board) &&
+    // Rotation
+    board.pulsesPerRevolution >= 1 &&
+    board.motorMinRpm >= 1 && board.motorMinRpm < board.motorMaxRpm &&
+    maxMeasurableRpm(board) >= board.motorMaxRpm &&
+    // LEDC can strobe the whole motor speed range at ledPwmResolution
+    board.gearingFactor > 0 &&
+    strobeFreqHz(board, board.motorMinRpm) >= ledcMinFreqHz(board) &&
+    strobeFreqHz(board, board.motorMaxRpm) <= ledcMaxFreqHz(board) &&
+    // Ring buffers are indexed with a uint8_t and wrapped with a mask
+    isPowerOfTwo(board.freqSampleNum) && board.freqSampleNum <= 256 &&
+    // Statistics window is wrapped with a mask, histogram bins are uint8_t indexed
+    isPowerOfTwo(board.statsWindowSize) &&
+    board.statsHistogramBins >= 2 && board.statsHistogramBins < 255 &&
+    // Scheduler heap is uint8_t indexed
+    board.schedulerQueueSize >= 1 && board.schedulerQueueSize < 255;
+}
+
+static_assert(isValidProfile(PROFILE_DEVKIT_V1), "esp32doit-devkit-v1 profile is invalid");
+static_assert(isValidProfile(PROFILE_NODEMCU_32S), "nodemcu-32s profile is invalid");
+static_assert(isValidProfile(PROFILE_NATIVE), "native profile is invalid");
+
+// Shorthands for the selected board, used by main.cpp
+constexpr double   FREQ_MEASURE_TICK_SECONDS = timerTickSeconds(BOARD);
+constexpr double   FREQ_MEASURE_MAX_RPM = maxMeasurableRpm(BOARD);
+constexpr uint16_t FREQ_SAMPLE_NUM = BOARD.freqSampleNum;
+constexpr uint16_t FREQ_SAMPLE_MASK = BOARD.freqSampleNum - 1;
+constexpr uint16_t STATS_WINDOW_SIZE = BOARD.statsWindowSize;
+constexpr uint16_t STATS_WINDOW_MASK = BOARD.statsWindowSize - 1;
+constexpr uint8_t  STATS_HISTOGRAM_BINS = BOARD.statsHistogramBins;
+constexpr double   STATS_HISTOGRAM_BIN_RPM = (double)BOARD.motorMaxRpm / BOARD.statsHistogramBins;
+constexpr double   LEDC_MIN_FREQ_HZ = ledcMinFreqHz(BOARD);
+constexpr double   LEDC_MAX_FREQ_HZ = ledcMaxFreqHz(BOARD);
+constexpr uint8_t  SCHEDULER_QUEUE_SIZE = BOARD.schedulerQueueSize;
+constexpr uint32_t CONTROL_TICK_MICROSECONDS = 1000000UL / BOARD.controlTicksPerSecond;
+
+#endif // BOARD_PROFILES_H
@@ -0,0 +1,158 @@
+#ifndef COMMAND_SCHEDULER_H
+#define COMMAND_SCHEDULER_H
+
+#include <stdint.h>
+#include <string.h>
+
+#include "board_profiles.h"
+#include "command_tokenizer.h"
+
+/** Time triggered command scheduler
+ * Holds command lines to run at a given control tick (the quarter second
+ * timer), so changes can be lined up ahead of time and land together on
+ * the same tick however long the Bluetooth link took to deliver them.
+ *
+ * The queue is a bounded binary min-heap ordered by the tick to run at,
+ * then by id so commands for the same tick run in the order they were
+ * sent. Adding and taking the next due entry are O(log n), cancelling is
+ * O(n) to find the entry. Nothing allocates, lines are copied in.
+ **/
+
+// Longest command line we will hold, including the terminating '\0'
+#define SCHEDULER_LINE_LENGTH         64
+
+struct ScheduledCommand {
+  uint32_t executeAtTick;
+  uint32_t id;
+  char     line[SCHEDULER_LINE_LENGTH];
+};
+
+struct CommandScheduler {
+  ScheduledCommand entries[SCHEDULER_QUEUE_SIZE];
+  uint8_t  count;
+  uint32_t nextId;
+};
+
+inline void commandSchedulerReset(CommandScheduler *scheduler) {
+  scheduler->count = 0;
+  scheduler->nextId = 1;
+}
+
+// Is tick 'a' before tick 'b', allowing for the counter wrapping
+inline bool tickBefore(uint32_t a, uint32_t b) {
+  return (int32_t)(a - b) < 0;
+}
+
+inline bool scheduledBefore(const ScheduledCommand &a, const ScheduledCommand &b) {
+  if (a.executeAtTick != b.executeAtTick) {
+    return tickBefore(a.executeAtTick, b.executeAtTick);
+  }
+  return a.id < b.id;
+}
+
+inline void scheduledSwap(ScheduledCommand *a, ScheduledCommand *b) {
+  ScheduledCommand temp = *a;
+  *a = *b;
+  *b = temp;
+}
+
+inline void commandSchedulerSiftUp(CommandScheduler *scheduler, uint8_t index) {
+  while (index > 0) {
+    uint8_t parent = (index - 1) / 2;
+    if (!scheduledBefore(scheduler->entries[index], scheduler->entries[parent])) {
+      return;
+    }
+    scheduledSwap(&scheduler->entries[index], &scheduler->entries[parent]);
+    index = parent;
+  }
+}
+
+inline void commandSchedulerSiftDown(CommandScheduler *scheduler, uint8_t index) {
+  while (true) {
+    uint8_t smallest = index;
+    uint16_t left = 2 * index + 1;
+    uint16_t right = 2 * index + 2;
+    if (left < scheduler->count && scheduledBefore(scheduler->entries[left], scheduler->entries[smallest])) {
+      smallest = left;
+    }
+    if (right < scheduler->count && scheduledBefore(scheduler->entries[right], scheduler->entries[smallest])) {
+      smallest = right;
+    }
+    if (smallest == index) {
+      return;
+    }
+    scheduledSwap(&scheduler->entries[index], &scheduler->entries[smallest]);
+    index = smallest;
+  }
+}
+
+// Take entry 'index' out of the heap, keeping it a heap
+inline void commandSchedulerRemoveAt(CommandScheduler *scheduler, uint8_t index) {
+  scheduler->count--;
+  if (index == scheduler->count) {
+    return;
+  }
+  scheduler->entries[index] = scheduler->entries[scheduler->count];
+  commandSchedulerSiftDown(scheduler, index);
+  commandSchedulerSiftUp(scheduler, index);
+}
+
+/** Queue 'line' to run at 'executeAtTick'
+ * Returns false if the queue is full or the line is too long, otherwise
+ * sets 'id' to the entry's id for listing and cancelling.
+ **/
+inline bool commandSchedulerAdd(CommandScheduler *scheduler, uint32_t executeAtTick, StrView line, uint32_t *id) {
+  if (scheduler->count >= SCHEDULER_QUEUE_SIZE || line.length >= SCHEDULER_LINE_LENGTH) {
+    return false;
+  }
+  ScheduledCommand *entry = &scheduler->entries[scheduler->count];
+  entry->executeAtTick = executeAtTick;
+  entry->id = scheduler->nextId++;
+  memcpy(entry->line, line.data, line.length);
+  entry->line[line.length] = '\0';
+  *id = entry->id;
+  scheduler->count++;
+  commandSchedulerSiftUp(scheduler, scheduler->count - 1);
+  return true;
+}
+
+// Remove the entry with 'id', returns false if there isn't one
+inline bool commandSchedulerCancel(CommandScheduler *scheduler, uint32_t id) {
+  for (uint8_t i = 0; i < scheduler->count; i++) {
+    if (scheduler->entries[i].id == id) {
+      commandSchedulerRemoveAt(scheduler, i);
+      return true;
+    }
+  }
+  return false;
+}
+
+/** Take the next entry due at or before 'nowTick' into 'due'
+ * Call until it returns false to get the whole batch for this tick.
+ **/
+inline bool commandSchedulerPopDue(CommandScheduler *scheduler, uint32_t nowTick, ScheduledCommand *due) {
+  if (scheduler->count == 0 || tickBefore(nowTick, scheduler->entries[0].executeAtTick)) {
+    return false;
+  }
+  *due = scheduler->entries[0];
+  commandSchedulerRemoveAt(scheduler, 0);
+  return true;
+}
+
+/** Fill 'order' with the heap indexes in the order they will run
+ * Returns the number of entries. Only used for listing, so a plain
+ * insertion sort is fine.
+ **/
+inline uint8_t commandSchedulerOrder(const CommandScheduler *scheduler, uint8_t order[SCHEDULER_QUEUE_SIZE]) {
+  for (uint8_t i = 0; i < scheduler->count; i++) {
+    uint8_t j = i;
+    while (j > 0 && scheduledBefore(scheduler->entries[i], scheduler->entries[order[j - 1]])) {
+      order[j] = order[j - 1];
+      j--;
+    }
+    order[j] = i;
+  }
+  return scheduler->count;
+}
+
+#endif // COMMAND_SCHEDULER_H
@@ -0,0 +1,357 @@
+#ifndef COMMAND_TOKENIZER_H
+#define COMMAND_TOKENIZER_H
+
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/** Zero copy command tokenizer
+ * Commands arrive as a line in the serial buffer. Rather than copy, trim and
+ * substring it (a heap allocation each), we walk it with 'views': a pointer
+ * into the buffer and a length. Nothing here allocates.
+ *
+ * A line holds one or more settings separated by spaces, ',' or ';':
+ *   freqDelta=1.5 duty=40
+ *   randomString="hello world"
+ * If the first token isn't a command name the whole line is one old style
+ * single letter command ('f500', 'sHello=world'), as it always was.
+ *
+ * Numbers are parsed strictly: the whole value has to be the number, so
+ * "12abc" is an error rather than 12, and "0" is fine.
+ **/
+
+// A view of part of a string, not null terminated
+struct StrView {
+  const char *data;
+  size_t      length;
+};
+
+inline StrView strView(const char *data, size_t length) {
+  return StrView{data, length};
+}
+
+inline bool isCommandSpace(char c) {
+  return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+inline bool isCommandSeparator(char c) {
+  return isCommandSpace(c) || c == ',' || c == ';';
+}
+
+inline StrView strViewTrim(StrView view) {
+  while (view.length > 0 && isCommandSpace(view.data[0])) {
+    view.data++;
+    view.length--;
+  }
+  while (view.length > 0 && isCommandSpace(view.data[view.length - 1])) {
+    view.length--;
+  }
+  return view;
+}
+
+inline bool strViewEquals(StrView view, const char *literal) {
+  size_t i = 0;
+  for (; i < view.length; i++) {
+    if (literal[i] == '\0' || literal[i] != view.data[i]) {
+      return false;
+    }
+  }
+  return literal[i] == '\0';
+}
+
+inline bool strViewEqualsIgnoreCase(StrView view, const char *literal) {
+  size_t i = 0;
+  for (; i < view.length; i++) {
+    char a = view.data[i];
+    char b = literal[i];
+    if (b == '\0') {
+      return false;
+    }
+    if (a >= 'A' && a <= 'Z') {
+      a += 'a' - 'A';
+    }
+    if (b >= 'A' && b <= 'Z') {
+      b += 'a' - 'A';
+    }
+    if (a != b) {
+      return false;
+    }
+  }
+  return literal[i] == '\0';
+}
+
+/** Strict string to long
+ * Optional sign then digits, nothing else. Returns false, leaving 'target'
+ * alone, on an empty string, stray characters or overflow.
+ **/
+inline bool parseLongStrict(StrView view, long *target) {
+  size_t i = 0;
+  bool negative = false;
+  if (i < view.length && (view.data[i] == '-' || view.data[i] == '+')) {
+    negative = view.data[i] == '-';
+    i++;
+  }
+  if (i == view.length) {
+    return false;
+  }
+  // Accumulate as a negative number, its range is one bigger
+  long value = 0;
+  for (; i < view.length; i++) {
+    char c = view.data[i];
+    if (c < '0' || c > '9') {
+      return false;
+    }
+    int digit = c - '0';
+    if (value < (LONG_MIN + digit) / 10) {
+      return false;
+    }
+    value = value * 10 - digit;
+  }
+  if (!negative) {
+    if (value == LONG_MIN) {
+      return false;
+    }
+    value = -value;
+  }
+  *target = value;
+  return true;
+}
+
+/** Strict string to double
+ * Optional sign, digits, optional '.' and digits, with at least one digit.
+ * No exponents, no "nan"/"inf". Returns false, leaving 'target' alone, if
+ * the string isn't exactly that.
+ **/
+inline bool parseDecimalStrict(StrView view, double *target) {
+  size_t i = 0;
+  bool negative = false;
+  if (i < view.length && (view.data[i] == '-' || view.data[i] == '+')) {
+    negative = view.data[i] == '-';
+    i++;
+  }
+  double value = 0;
+  bool anyDigits = false;
+  for (; i < view.length && view.data[i] >= '0' && view.data[i] <= '9'; i++) {
+    value = value * 10 + (view.data[i] - '0');
+    anyDigits = true;
+  }
+  if (i < view.length && view.data[i] == '.') {
+    i++;
+    double scale = 0.1;
+    for (; i < view.length && view.data[i] >= '0' && view.data[i] <= '9'; i++) {
+      value += (view.data[i] - '0') * scale;
+      scale *= 0.1;
+      anyDigits = true;
+    }
+  }
+  if (!anyDigits || i != view.length) {
+    return false;
+  }
+  *target = negative ? -value : value;
+  return true;
+}
+
+// One 'key' or 'key=value' from the line
+struct CommandToken {
+  StrView key;
+  StrView value;
+  bool    hasValue;
+};
+
+// Where we are up to in the line
+struct CommandTokenizer {
+  const char *position;
+  const char *end;
+};
+
+inline CommandTokenizer commandTokenizerBegin(const char *data, size_t length) {
+  return CommandTokenizer{data, data + length};
+}
+
+/** Get the next token from the line
+ * Returns false when there are no more. A value may be double quoted to
+ * include separators, the quotes are not part of the value.
+ **/
+inline bool commandTokenizerNext(CommandTokenizer *tokenizer, CommandToken *token) {
+  const char *p = tokenizer->position;
+  const char *end = tokenizer->end;
+  while (p < end && isCommandSeparator(*p)) {
+    p++;
+  }
+  if (p == end) {
+    tokenizer->position = p;
+    return false;
+  }
+
+  const char *keyStart = p;
+  while (p < end && !isCommandSeparator(*p) && *p != '=') {
+    p++;
+  }
+  token->key = strView(keyStart, p - keyStart);
+  token->hasValue = false;
+  token->value = strView(p, 0);
+
+  if (p < end && *p == '=') {
+    p++;
+    token->hasValue = true;
+    if (p < end && *p == '"') {
+      const char *valueStart = ++p;
+      while (p < end && *p != '"') {
+        p++;
+      }
+      token->value = strView(valueStart, p - valueStart);
+      // Step over the closing quote, if there is one
+      if (p < end) {
+        p++;
+      }
+    } else {
+      const char *valueStart = p;
+      while (p < end && !isCommandSeparator(*p)) {
+        p++;
+      }
+      token->value = strView(valueStart, p - valueStart);
+    }
+  }
+
+  tokenizer->position = p;
+  return true;
+}
+
+// Argument types
+#define ARGUMENT_TYPE_NONE            0
+#define ARGUMENT_TYPE_LONG            1
+#define ARGUMENT_TYPE_DOUBLE          2
+#define ARGUMENT_TYPE_STRING          3
+
+// A 'struct' to hold parsed commands and arguments
+// 'argString' is a view into the input line, not a copy
+struct CommandAndArguments {
+  char    command;
+  int     argType;
+  long    argLong;
+  double  argDouble;
+  StrView argString;
+  bool    named;
+  bool    parseState;
+};
+
+// The long names of commands, for 'name=value' settings
+struct CommandName {
+  char        command;
+  const char *name;
+};
+const CommandName commandNames[] = {
+  {'h', "help"},
+  {'f', "setFreq"},
+  {'p', "useSetFreq"},
+  {'d', "pwmDuty"},
+  {'m', "freqDelta"},
+  {'v', "runVariableDelta"},
+  {'r', "freqConversionFactor"},
+  {'s', "randomString"},
+  {'l', "ledEnable"},
+  {'L', "logging"},
+  {'S', "stats"},
+  {'t', "stallTimeoutMs"},
+  {'i', "idleLedMode"},
+  {'z', "idleSleep"},
+  {'X', "cancel"},
+};
+
+// Look up a long command name, returns 0 if there is no such name
+inline char commandFromName(StrView name) {
+  for (size_t i = 0; i < sizeof(commandNames) / sizeof(commandNames[0]); i++) {
+    if (strViewEquals(name, commandNames[i].name)) {
+      return commandNames[i].command;
+    }
+  }
+  return 0;
+}
+
+/** Work out the argument type of 'argument'
+ * Strictly a whole number is a long, strictly a decimal is a double, and
+ * anything else is a string. Decimals are only allowed for named settings,
+ * the old form takes whole numbers. 'm1.5' used to be read by toInt() as 1,
+ * setting freqDelta to 0.01, strict parsing now rejects it instead.
+ **/
+inline void parseArgument(StrView argument, CommandAndArguments *comArgs) {
+  comArgs->argString = argument;
+  if (argument.length == 0) {
+    comArgs->argType = ARGUMENT_TYPE_NONE;
+  } else if (parseLongStrict(argument, &comArgs->argLong)) {
+    comArgs->argType = ARGUMENT_TYPE_LONG;
+    comArgs->argDouble = comArgs->argLong;
+  } else if (comArgs->named && parseDecimalStrict(argument, &comArgs->argDouble)) {
+    comArgs->argType = ARGUMENT_TYPE_DOUBLE;
+  } else {
+    comArgs->argType = ARGUMENT_TYPE_STRING;
+  }
+}
+
+// Where we are up to in a line of commands
+struct CommandLine {
+  StrView          line;
+  CommandTokenizer tokenizer;
+  bool             named;
+  bool             done;
+};
+
+/** Start reading the commands on 'line'
+ * Returns false if there are none. The line is named settings only if its
+ * first token is a command name, with or without a value. Otherwise it is
+ * one old style command, so 'sHello=world' sets randomString to
+ * "Hello=world" rather than being an unknown 'sHello' setting.
+ **/
+inline bool commandLineBegin(CommandLine *commandLine, StrView line) {
+  commandLine->line = strViewTrim(line);
+  commandLine->tokenizer = commandTokenizerBegin(commandLine->line.data, commandLine->line.length);
+  commandLine->done = commandLine->line.length == 0;
+
+  CommandTokenizer peek = commandLine->tokenizer;
+  CommandToken first;
+  commandLine->named = commandTokenizerNext(&peek, &first) && commandFromName(first.key) != 0;
+  return !commandLine->done;
+}
+
+/** Parse the next command on the line into 'comArgs'
+ * Returns false when there are no more. 'key' is set to the setting name as
+ * sent, for messages. An unknown name in a line of named settings comes
+ * back with 'parseState' EXIT_FAILURE.
+ **/
+inline bool commandLineNext(CommandLine *commandLine, CommandAndArguments *comArgs, StrView *key) {
+  if (commandLine->done) {
+    return false;
+  }
+  *comArgs = CommandAndArguments{
+    'h', ARGUMENT_TYPE_NONE, 0, 0, strView(commandLine->line.data, 0), false, EXIT_SUCCESS
+  };
+
+  if (!commandLine->named) {
+    // Old style, the command is the first character and the argument the rest
+    StrView line = commandLine->line;
+    *key = strView(line.data, 1);
+    comArgs->command = line.data[0];
+    parseArgument(strViewTrim(strView(line.data + 1, line.length - 1)), comArgs);
+    commandLine->done = true;
+    return true;
+  }
+
+  CommandToken token;
+  if (!commandTokenizerNext(&commandLine->tokenizer, &token)) {
+    commandLine->done = true;
+    return false;
+  }
+  *key = token.key;
+  comArgs->command = commandFromName(token.key);
+  if (comArgs->command == 0) {
+    comArgs->command = 'h';
+    comArgs->parseState = EXIT_FAILURE;
+    return true;
+  }
+  comArgs->named = true;
+  parseArgument(token.value, comArgs);
+  return true;
+}
+
+#endif // COMMAND_TOKENIZER_H
@@ -0,0 +1,161 @@
+#ifndef ROTATION_STATS_H
+#define ROTATION_STATS_H
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "board_profiles.h"
+
+/** Online rotation statistics
+ * Fed one period (in frequency measure timer ticks) per edge, this keeps
+ * enough to tell a worn motor, loose magnet or slipping belt from normal
+ * running:
+ *   * Mean and variance of the period (Welford's method, no sum overflow)
+ *   * Min and max period
+ *   * Cycle to cycle jitter, the RMS and max of the change between periods.
+ *     Only periods that follow each other count, rotationStatsBreakChain()
+ *     stops a re-lock or a skipped period looking like a jump in speed
+ *   * A lifetime RPM histogram
+ *   * Percentiles over the last STATS_WINDOW_SIZE edges
+ *
+ * Every update is O(1) and memory is fixed. The percentile window keeps the
+ * histogram bin of each edge in a ring, and a per bin count for the window,
+ * so an edge entering and an edge leaving are one increment and one
+ * decrement. Percentiles are only worked out when asked for.
+ **/
+
+// A 'struct' holding the running statistics
+struct RotationStats {
+  uint32_t count;           // Periods added since reset
+  double   meanPeriod;      // Ticks
+  double   m2Period;        // Sum of squared differences from the mean
+  uint64_t minPeriod;
+  uint64_t maxPeriod;
+  uint64_t prevPeriod;
+  bool     havePrevPeriod;    // False after a reset or a break in the periods
+  uint32_t jitterCount;       // Period to period changes seen
+  double   jitterMeanSquare;  // Mean of (period - prevPeriod)^2, ticks^2
+  uint64_t jitterMax;         // Largest period to period change, ticks
+  uint32_t histogram[STATS_HISTOGRAM_BINS];
+  // Percentile window
+  uint8_t  windowBins[STATS_WINDOW_SIZE];
+  uint16_t windowCounts[STATS_HISTOGRAM_BINS];
+  uint16_t windowIndex;
+  uint16_t windowFill;
+};
+
+// Convert a period in timer ticks to motor RPM, 0 for a 0 period
+inline double periodTicksToRpm(double periodTicks) {
+  if (periodTicks <= 0) {
+    return 0;
+  }
+  return 60.0 / (periodTicks * FREQ_MEASURE_TICK_SECONDS * BOARD.pulsesPerRevolution);
+}
+
+// Histogram bin for an RPM, anything at or above motorMaxRpm goes in the last bin
+inline uint8_t rpmToHistogramBin(double rpm) {
+  uint32_t bin = (uint32_t)(rpm / STATS_HISTOGRAM_BIN_RPM);
+  if (bin >= STATS_HISTOGRAM_BINS) {
+    bin = STATS_HISTOGRAM_BINS - 1;
+  }
+  return (uint8_t)bin;
+}
+
+inline void rotationStatsReset(RotationStats *stats) {
+  memset(stats, 0, sizeof(RotationStats));
+}
+
+// The next period doesn't follow the last one added, don't compare them
+inline void rotationStatsBreakChain(RotationStats *stats) {
+  stats->havePrevPeriod = false;
+}
+
+/** Add one period, in timer ticks, to the statistics
+ * Call once per edge from the main loop, not the ISR, it uses doubles
+ **/
+inline void rotationStatsAddPeriod(RotationStats *stats, uint64_t period) {
+  stats->count++;
+
+  // Welford's online mean/variance
+  double delta = period - stats->meanPeriod;
+  stats->meanPeriod += delta / stats->count;
+  stats->m2Period += delta * (period - stats->meanPeriod);
+
+  // Min/max
+  if (stats->count == 1) {
+    stats->minPeriod = period;
+    stats->maxPeriod = period;
+  } else {
+    if (period < stats->minPeriod) {
+      stats->minPeriod = period;
+    }
+    if (period > stats->maxPeriod) {
+      stats->maxPeriod = period;
+    }
+  }
+
+  // Jitter, which needs the period just before this one to compare against
+  if (stats->havePrevPeriod) {
+    uint64_t change = period > stats->prevPeriod ?
+      period - stats->prevPeriod : stats->prevPeriod - period;
+    if (change > stats->jitterMax) {
+      stats->jitterMax = change;
+    }
+    // Running mean of the squared change
+    stats->jitterCount++;
+    stats->jitterMeanSquare += ((double)change * change - stats->jitterMeanSquare) / stats->jitterCount;
+  }
+  stats->prevPeriod = period;
+  stats->havePrevPeriod = true;
+
+  // Histograms
+  uint8_t bin = rpmToHistogramBin(periodTicksToRpm(period));
+  stats->histogram[bin]++;
+  if (stats->windowFill == STATS_WINDOW_SIZE) {
+    // Window is full, the edge we overwrite leaves the window
+    stats->windowCounts[stats->windowBins[stats->windowIndex]]--;
+  } else {
+    stats->windowFill++;
+  }
+  stats->windowBins[stats->windowIndex] = bin;
+  stats->windowCounts[bin]++;
+  stats->windowIndex = (stats->windowIndex + 1) & STATS_WINDOW_MASK;
+}
+
+// Sample standard deviation of the period in ticks
+inline double rotationStatsPeriodStdDev(const RotationStats *stats) {
+  if (stats->count < 2) {
+    return 0;
+  }
+  return sqrt(stats->m2Period / (stats->count - 1));
+}
+
+// RMS cycle to cycle jitter in ticks
+inline double rotationStatsJitterRms(const RotationStats *stats) {
+  return sqrt(stats->jitterMeanSquare);
+}
+
+/** RPM at 'percentile' (0 to 100) over the window
+ * Walks the window histogram and interpolates within the bin, so the
+ * answer is good to a fraction of STATS_HISTOGRAM_BIN_RPM.
+ * Returns 0 if the window is empty.
+ **/
+inline double rotationStatsWindowPercentileRpm(const RotationStats *stats, double percentile) {
+  if (stats->windowFill == 0) {
+    return 0;
+  }
+  double target = percentile / 100.0 * stats->windowFill;
+  uint32_t seen = 0;
+  for (uint8_t bin = 0; bin < STATS_HISTOGRAM_BINS; bin++) {
+    uint16_t inBin = stats->windowCounts[bin];
+    if (inBin > 0 && seen + inBin >= target) {
+      double fraction = (target - seen) / inBin;
+      return (bin + fraction) * STATS_HISTOGRAM_BIN_RPM;
+    }
+    seen += inBin;
+  }
+  return STATS_HISTOGRAM_BINS * STATS_HISTOGRAM_BIN_RPM;
+}
+
+#endif // ROTATION_STATS_H
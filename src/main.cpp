@@ -20,58 +20,57 @@
  * 
  **/
 #include "BluetoothSerial.h"
+#include "driver/gpio.h"
+#include "esp_sleep.h"
+#include "esp_timer.h"
+#include "board_profiles.h"
+#include "command_scheduler.h"
+#include "command_tokenizer.h"
+#include "rotation_stats.h"
 
 #define COOL_PERIOD_SECONDS           120
 
-// Argument type defines
-#define ARGUMENT_TYPE_NONE            0
-#define ARGUMENT_TYPE_LONG            1
-#define ARGUMENT_TYPE_DOUBLE          2
-#define ARGUMENT_TYPE_STRING          3
-
 // Defines
-// Motor to Zeo rotation conversion factor
-#define MOTOR_ZEO_GEARING_FACTOR      0.26
-// The 'pin' the LED is on - In the case of NodeMCU pin2 is the onboard led
-#define LED_ONBOARD_PIN               2
-#define LED_PIN                       12
-// DEVKIT V1 uses pin 23
-// #define LED_PIN               23
-// The PWM channel for the LED 0 to 15
-#define LED_PWM_CHANNEL               0
-// PWM resolution in bits
-#define LED_PWM_RESOLUTION            8
-// PWM inital duty
-#define LED_PWM_INITAL_DUTY           32
-
-// Frequency measure
-#define FREQ_MEASURE_PIN              19
-#define FREQ_MEASURE_TIMER            1
-#define FREQ_MEASURE_TIMER_PRESCALAR  80
-#define FREQ_MEASURE_TIMER_COUNT_UP   true
-#define FREQ_MEASURE_TIMER_PERIOD     FREQ_MEASURE_TIMER_PRESCALAR/F_CPU
-#define FREQ_MEASUER_SAMPLE_NUM       64
-// this returns a pointer to the hw_timer_t global variable
-// 0 = first timer
-// 80 is prescaler so 80MHZ divided by 80 = 1MHZ signal ie 0.000001 of a second
-// true - counts up
+// Stall detection: an edge later than this many periods means spinning down
+#define STALL_SPIN_DOWN_PERIODS       2
+#define STALL_TIMEOUT_MS_DEFAULT      2000
+#define STALL_TIMEOUT_MS_MIN          1
+#define STALL_TIMEOUT_MS_MAX          3600000
+
+// Rotation state defines
+#define ROTATION_STATE_RUNNING        0
+#define ROTATION_STATE_SPINNING_DOWN  1
+#define ROTATION_STATE_IDLE           2
+
+// Idle LED behaviour defines
+#define IDLE_LED_OFF                  0
+#define IDLE_LED_ON                   1
+#define IDLE_LED_STROBE               2
+
+// Pins, timers, prescalers and buffer sizes come from the board profile
+// selected in platformio.ini, see include/board_profiles.h
 
 //Timers and counters and things
-/** Timer and process control **/
+/** Timer and process control
+ * The control (quarter second) tick runs from esp_timer rather than a
+ * hardware timer. esp_timer keeps time through light sleep, and it fires on
+ * whole control ticks from 'controlTickOrigin', so the loop, the scheduled
+ * commands and the logged seconds all go by the same clock.
+ **/
 uint32_t timestamp = 0;
-int timestampQuarter = 0;
-hw_timer_t * timer = NULL;
+esp_timer_handle_t controlTimer = NULL;
+int64_t controlTickOrigin = 0;
 volatile SemaphoreHandle_t timerSemaphore;
-portMUX_TYPE timerMux = portMUX_INITIALIZER_UNLOCKED;
 
-void IRAM_ATTR onTimer(){
-  // Increment the counter and set the time of ISR
-  portENTER_CRITICAL_ISR(&timerMux);
-  timestampQuarter++;
-  portEXIT_CRITICAL_ISR(&timerMux);
+// esp_timer callback, this runs in the esp_timer task not an ISR
+void onTimer(void *arg) {
   // Give a semaphore that we can check in the loop
-  xSemaphoreGiveFromISR(timerSemaphore, NULL);
-  // It is safe to use digitalRead/Write here if you want to toggle an output
+  xSemaphoreGive(timerSemaphore);
+}
+
+// Control ticks since the control timer started, the timebase for everything
+uint32_t readControlTicks() {
+  return (uint32_t)((esp_timer_get_time() - controlTickOrigin) / CONTROL_TICK_MICROSECONDS);
 }
 
 /** Timer for measuring freq **/
@@ -79,12 +78,22 @@ volatile uint64_t StartValue;                     // First interrupt value
 bool fAdded = false;
 // Our own Ring Buffer
 uint8_t ringIndex = 0;
-uint64_t myRing[FREQ_MEASUER_SAMPLE_NUM] = {0};
+// Total periods recorded, lets the statistics know how many are new
+volatile uint32_t edgeCount = 0;
+// Periods in the ring since the last re-lock, saturates at FREQ_SAMPLE_NUM
+volatile uint16_t ringFill = 0;
+// Set when StartValue is stale (at boot and after a stall). The next edge
+// only restarts the measurement, it doesn't record a period
+volatile bool freqRelock = true;
+uint64_t myRing[FREQ_SAMPLE_NUM] = {0};
 // average freq intermediate values as globals. Bite me!
 uint64_t sumPeriod;
 float avgPeriod;
 // prev freq for freq compare
 long prevFreq = 0;
+// Set once pwmFreq has been worked out from the ring since the last re-lock,
+// until then pwmFreq is from before the stall
+boolean freqEstimated = false;
 
 hw_timer_t * fTimer = NULL;                       // pointer to a variable of type hw_timer_t 
 portMUX_TYPE fTimerMux = portMUX_INITIALIZER_UNLOCKED;  // synchs between maon cose and interrupt?
@@ -99,22 +108,112 @@ void IRAM_ATTR handleFrequencyMeasureInterrupt()
       // uint8_t blah = 8;
       // value of timer at interrupt
       uint64_t TempVal= timerRead(fTimer);
-      if (ringIndex == FREQ_MEASUER_SAMPLE_NUM -1 ) {
-        ringIndex = 0;
-      } else {
-        ringIndex++;
+      if (freqRelock) {
+        StartValue = TempVal;
+        freqRelock = false;
+        portEXIT_CRITICAL_ISR(&fTimerMux);
+        return;
       }
-      // // Add period to RunningAverage, period is in number of FREQ_MEASURE_TIMER_PERIOD
+      // Ring size is a power of two so wrapping is a mask, not a branch
+      ringIndex = (ringIndex + 1) & FREQ_SAMPLE_MASK;
+      // // Add period to RunningAverage, period is in number of FREQ_MEASURE_TICK_SECONDS
       // // Note: Is timer overflow safe
       // This one MOFO's
       myRing[ringIndex]= TempVal - StartValue;
       // frequencyRA.addValue(TempVal - StartValue);
       // // puts latest reading as start for next calculation
       StartValue = TempVal;
+      edgeCount++;
+      if (ringFill < FREQ_SAMPLE_NUM) {
+        ringFill++;
+      }
       fAdded = true;
   portEXIT_CRITICAL_ISR(&fTimerMux);
 }
 
+/** Rotation statistics **/
+RotationStats rotationStats;
+// Edges already fed to the statistics, ones we fell too far behind to see,
+// and ones left out as the motor wasn't running steadily
+uint32_t statsEdgeCount = 0;
+uint32_t statsEdgesDropped = 0;
+uint32_t statsEdgesSkipped = 0;
+
+/** Feed the periods the ISR has recorded since last time into the statistics
+ * The ring only holds FREQ_SAMPLE_NUM periods, so if we get further behind
+ * than that the oldest are counted as dropped rather than read as garbage.
+ * We stay one slot short of a full ring so the ISR can't overwrite the
+ * period we are reading.
+ * Only steady running counts: periods while spinning down, and the first
+ * ring full after a re-lock (spinning up), are skipped. Otherwise every
+ * stop and start would show up as jitter and in the min/max and histogram.
+ * Anything missed breaks the jitter chain.
+ **/
+void updateRotationStats(uint8_t state) {
+  portENTER_CRITICAL(&fTimerMux);
+  uint32_t edges = edgeCount;
+  uint8_t newestIndex = ringIndex;
+  portEXIT_CRITICAL(&fTimerMux);
+
+  uint32_t pending = edges - statsEdgeCount;
+  if (pending > FREQ_SAMPLE_NUM - 1) {
+    statsEdgesDropped += pending - (FREQ_SAMPLE_NUM - 1);
+    statsEdgeCount = edges - (FREQ_SAMPLE_NUM - 1);
+    rotationStatsBreakChain(&rotationStats);
+  }
+  boolean steady = state == ROTATION_STATE_RUNNING && ringFill == FREQ_SAMPLE_NUM;
+
+  while (statsEdgeCount != edges) {
+    statsEdgeCount++;
+    // Ring slot of edge 'statsEdgeCount', counting back from the newest
+    uint8_t index = (newestIndex - (edges - statsEdgeCount)) & FREQ_SAMPLE_MASK;
+    if (!steady) {
+      statsEdgesSkipped++;
+      rotationStatsBreakChain(&rotationStats);
+      continue;
+    }
+    portENTER_CRITICAL(&fTimerMux);
+    uint64_t period = myRing[index];
+    portEXIT_CRITICAL(&fTimerMux);
+    rotationStatsAddPeriod(&rotationStats, period);
+  }
+}
+
+double ticksToMicros(double ticks) {
+  return ticks * FREQ_MEASURE_TICK_SECONDS * 1000000.0;
+}
+
+// One line summary, used in the logging output
+String formatRotationStats(const RotationStats &stats) {
+  return String("edges: ") + String(stats.count) +
+    " rpmMean: " + String(periodTicksToRpm(stats.meanPeriod), 1) +
+    " periodStdUs: " + String(ticksToMicros(rotationStatsPeriodStdDev(&stats)), 1) +
+    " jitterRmsUs: " + String(ticksToMicros(rotationStatsJitterRms(&stats)), 1) +
+    " rpmP5: " + String(rotationStatsWindowPercentileRpm(&stats, 5), 1) +
+    " rpmP50: " + String(rotationStatsWindowPercentileRpm(&stats, 50), 1) +
+    " rpmP95: " + String(rotationStatsWindowPercentileRpm(&stats, 95), 1);
+}
+
+// Everything, including the histogram, for the 'S' command
+String formatRotationStatsReport(const RotationStats &stats) {
+  String report = "Rotation stats: " + formatRotationStats(stats) +
+    "\nperiodMeanUs: " + String(ticksToMicros(stats.meanPeriod), 1) +
+    " periodMinUs: " + String(ticksToMicros(stats.minPeriod), 1) +
+    " periodMaxUs: " + String(ticksToMicros(stats.maxPeriod), 1) +
+    " jitterMaxUs: " + String(ticksToMicros(stats.jitterMax), 1) +
+    " dropped: " + String(statsEdgesDropped) +
+    " notSteady: " + String(statsEdgesSkipped) +
+    "\nRPM histogram:";
+  for (uint8_t bin = 0; bin < STATS_HISTOGRAM_BINS; bin++) {
+    if (stats.histogram[bin] == 0) {
+      continue;
+    }
+    report += "\n  " + String((long)(bin * STATS_HISTOGRAM_BIN_RPM)) + "-" +
+      String((long)((bin + 1) * STATS_HISTOGRAM_BIN_RPM)) + ": " + String(stats.histogram[bin]);
+  }
+  return report;
+}
+
 // Create a BluetoothSerial thingee
 BluetoothSerial SerialBT;
 
@@ -136,22 +235,194 @@ struct ProgramVars {
   bool    logging;
   bool    stateChange;
   String  randomString;
+  long    stallTimeoutMs;
+  long    idleLedMode;
+  bool    idleSleep;
 };
 // This creates a new variable which is of the above struct type
 ProgramVars programVars = {
   0,      // pwmFreq
   0,      // setFreq
   false,  // useSetFreq
-  LED_PWM_INITAL_DUTY,      // pwmDutyThou
+  BOARD.ledPwmInitialDuty, // pwmDutyThou
   1.0,    // freqDelta
   true,    // runVariableDelta
-  MOTOR_ZEO_GEARING_FACTOR, // freqConversionFactor
+  BOARD.gearingFactor, // freqConversionFactor
   true,   // ledEnable
   false,  //  logging
   false,  // stateChange
-  ""      //randomString
+  "",     //randomString
+  STALL_TIMEOUT_MS_DEFAULT, // stallTimeoutMs
+  IDLE_LED_OFF, // idleLedMode
+  false   // idleSleep, off by default as light sleep drops the Bluetooth link
 };
 
+/** Stall detection
+ * When the motor stops no more edges arrive, so we watch the time since the
+ * last one:
+ *   * RUNNING: edges arriving on time
+ *   * SPINNING_DOWN: the next edge is more than STALL_SPIN_DOWN_PERIODS late
+ *   * IDLE: no edge for 'stallTimeoutMs'. The ring is cleared, the LED goes
+ *     to 'idleLedMode' and, if 'idleSleep' is set, we light sleep until an
+ *     edge (or the next control tick) wakes us.
+ * The first edge after IDLE re-locks the measurement from a clean state, and
+ * the frequency is worked out from however many periods we have so far.
+ **/
+uint8_t rotationState = ROTATION_STATE_IDLE;
+
+String rotationStateName(uint8_t state) {
+  switch (state) {
+    case ROTATION_STATE_RUNNING:
+      return "running";
+    case ROTATION_STATE_SPINNING_DOWN:
+      return "spinning-down";
+    default:
+      return "idle";
+  }
+}
+
+// Can LEDC strobe at 'freq' at BOARD.ledPwmResolution
+boolean strobeFrequencyInRange(long freq) {
+  return freq >= LEDC_MIN_FREQ_HZ && freq <= LEDC_MAX_FREQ_HZ;
+}
+
+/** Set the strobe frequency
+ * ledcWriteTone() would switch the channel to 10 bits whatever we set up,
+ * so we use ledcSetup() and keep BOARD.ledPwmResolution.
+ * A frequency LEDC can't do leaves the timer alone and outputDuty() turns
+ * the LED off, a strobe at the wrong frequency is worse than none. Returns
+ * false then, with a message unless the frequency is just 0.
+ * Write the duty again afterwards.
+ **/
+boolean writeStrobeFrequency(long freq, String *message) {
+  if (!strobeFrequencyInRange(freq)) {
+    *message = freq > 0 ? "Strobe frequency " + String(freq) + " Hz is outside " +
+      String(LEDC_MIN_FREQ_HZ, 2) + " to " + String(LEDC_MAX_FREQ_HZ, 0) + " Hz, LED off" : "";
+    return false;
+  }
+  ledcSetup(BOARD.ledPwmChannel, freq, BOARD.ledPwmResolution);
+  return true;
+}
+
+// The duty the LED should be at right now, allowing for disabled and idle
+long outputDuty(const ProgramVars *progVars, uint8_t state) {
+  if (progVars->ledEnable == false) {
+    return 0;
+  }
+  if (state == ROTATION_STATE_IDLE) {
+    switch (progVars->idleLedMode) {
+      case IDLE_LED_ON:
+        // A duty of 2^resolution is fully on. writeStrobeFrequency() keeps
+        // the channel at BOARD.ledPwmResolution, so this is the right power
+        return 1L << BOARD.ledPwmResolution;
+      case IDLE_LED_STROBE:
+        return strobeFrequencyInRange(progVars->pwmFreq) ? progVars->pwmDutyThou : 0;
+      default:
+        return 0;
+    }
+  }
+  // No frequency, no strobe. ledcWriteTone(0) used to do this for us.
+  // Nor if LEDC can't do the frequency, see writeStrobeFrequency()
+  if (!strobeFrequencyInRange(progVars->pwmFreq)) {
+    return 0;
+  }
+  // Nor while spinning up, until there is a measured frequency to strobe at
+  if (!progVars->useSetFreq && !freqEstimated) {
+    return 0;
+  }
+  return progVars->pwmDutyThou;
+}
+
+/** Work out the rotation state from the time since the last edge
+ * With a set frequency ('useSetFreq') the strobe doesn't depend on the
+ * sensor, so there is nothing to stall and we are always running.
+ * Returns true if the state changed
+ **/
+boolean updateRotationState(const ProgramVars *progVars, uint8_t *state) {
+  if (progVars->useSetFreq) {
+    if (*state == ROTATION_STATE_RUNNING) {
+      return false;
+    }
+    *state = ROTATION_STATE_RUNNING;
+    return true;
+  }
+
+  portENTER_CRITICAL(&fTimerMux);
+  bool waitingForEdge = freqRelock;
+  uint64_t sinceLastEdge = timerRead(fTimer) - StartValue;
+  uint64_t lastPeriod = myRing[ringIndex];
+  uint16_t fill = ringFill;
+  portEXIT_CRITICAL(&fTimerMux);
+
+  uint64_t stallTicks = progVars->stallTimeoutMs / (1000.0 * FREQ_MEASURE_TICK_SECONDS);
+  uint8_t newState;
+  if (waitingForEdge || sinceLastEdge > stallTicks) {
+    newState = ROTATION_STATE_IDLE;
+  } else if (fill > 0 && sinceLastEdge > STALL_SPIN_DOWN_PERIODS * lastPeriod) {
+    newState = ROTATION_STATE_SPINNING_DOWN;
+  } else {
+    // Includes spinning up, where we have an edge but no period yet
+    newState = ROTATION_STATE_RUNNING;
+  }
+
+  if (newState == *state) {
+    return false;
+  }
+  if (newState == ROTATION_STATE_IDLE) {
+    // Forget the stale periods and re-lock on the next edge
+    portENTER_CRITICAL(&fTimerMux);
+    memset(myRing, 0, sizeof(myRing));
+    ringFill = 0;
+    freqRelock = true;
+    portEXIT_CRITICAL(&fTimerMux);
+    freqEstimated = false;
+    rotationStatsBreakChain(&rotationStats);
+  }
+  *state = newState;
+  return true;
+}
+
+/** Light sleep until the sensor pin changes or the next control tick
+ * We wake on the opposite level to the one the pin sits at now, so a magnet
+ * parked on the sensor doesn't wake us straight back up. esp_timer doesn't
+ * wake us by itself, so we wake on the next tick and let onTimer() give it.
+ * The wakeup makes the pin a level interrupt, so the edge interrupt is
+ * off while we sleep or handleFrequencyMeasureInterrupt() would fire for
+ * as long as the level holds after waking.
+ * Returns false if the sleep was refused (eg Bluetooth is running).
+ **/
+boolean idleLightSleep() {
+  gpio_int_type_t wakeLevel = digitalRead(BOARD.freqMeasurePin) == HIGH ?
+    GPIO_INTR_LOW_LEVEL : GPIO_INTR_HIGH_LEVEL;
+  gpio_intr_disable((gpio_num_t)BOARD.freqMeasurePin);
+  gpio_wakeup_enable((gpio_num_t)BOARD.freqMeasurePin, wakeLevel);
+  esp_sleep_enable_gpio_wakeup();
+  int64_t sinceTick = (esp_timer_get_time() - controlTickOrigin) % CONTROL_TICK_MICROSECONDS;
+  esp_sleep_enable_timer_wakeup(CONTROL_TICK_MICROSECONDS - sinceTick);
+  // Let the serial port drain, it stops while we sleep
+  Serial.flush();
+
+  esp_err_t sleepResult = esp_light_sleep_start();
+  // Put the falling edge interrupt back the way attachInterrupt() had it
+  gpio_wakeup_disable((gpio_num_t)BOARD.freqMeasurePin);
+  gpio_set_intr_type((gpio_num_t)BOARD.freqMeasurePin, GPIO_INTR_NEGEDGE);
+  esp_sleep_disable_wakeup_source(ESP_SLEEP_WAKEUP_ALL);
+  if (sleepResult != ESP_OK) {
+    gpio_intr_enable((gpio_num_t)BOARD.freqMeasurePin);
+    return false;
+  }
+
+  if (esp_sleep_get_wakeup_cause() == ESP_SLEEP_WAKEUP_GPIO) {
+    // The measure timer stopped while we slept and the waking edge wasn't
+    // timed, so start measuring again from the next one
+    portENTER_CRITICAL(&fTimerMux);
+    freqRelock = true;
+    portEXIT_CRITICAL(&fTimerMux);
+  }
+  gpio_intr_enable((gpio_num_t)BOARD.freqMeasurePin);
+  return true;
+}
+
 
 /** This function takes a string and separates out the command and argument
  * The command is the first character, the argument is the remainder
@@ -173,231 +444,402 @@ ProgramVars programVars = {
    return EXIT_SUCCESS;
  }
 
- /** stringToLong function that returns state
-  * Why is state important?
-  * The standard string to integer functions the integer representation
-  * of a string if one exists and 0 if it does not (i.e atoi('a') = 0)
-  * This is **shit** because "0" is a valid and common number
-  * If the string cannot be converted then we should know about it.
-  * 
-  * To do this we use a function that returns a state and modifes a
-  * pointer to an int if the conversion is successful
-  * 
-  **/
-  int stringToLong(String inputString, long *targetInt) {
-    // convert the input string to an integer
-    int32_t intTemp = inputString.toInt();
-    // If the resulting integer is not 0 then no problem
-    if (intTemp != 0) {
-      *targetInt = intTemp;
-      return EXIT_SUCCESS;
-    // If the input string is literally "0" no problem
-    } else if (inputString == "0") {
-      *targetInt = 0;
-      return EXIT_SUCCESS;
-    // Otherwise there was a problem
-    } else {
-      return EXIT_FAILURE;
-    }    
-  }
-
-  // A 'struct' to hold parsed commands and arguments
-  struct CommandAndArguments {
-    char    command;
-    int     argType;
-    long    argLong;
-    String  argString;
-    boolean parseState;
-  };
-
-  /** Parse the command/args string
-   * Find the command if present, and parse the arguments
-   * determining where there are none, are a number, or a string
-   **/
-  CommandAndArguments parseCommandArgs(String commandArgs) {
-    char comChar = 'h';
-    int argType = ARGUMENT_TYPE_NONE;
-    long argLong = 0;
-    String argString = "";
-
-
-    // Trim the result, include removing the trailing '/n'
-    commandArgs.trim();
-
-    // Check that the String is long enough to process and return fail otherwise
-    if (commandArgs.length() == 0) {
-      return CommandAndArguments{
-        comChar, argType, argLong, argString, EXIT_FAILURE
-      };
-    } 
-    // Get the command
-    comChar = commandArgs.charAt(0);
-
-    // If there are enough characters in 'commandArgs' get and parse them
-    if (commandArgs.length() > 1) {
-      // Separate the argument from the command
-      argString = commandArgs.substring(1);
-      // If we can convert the argString to a number we do
-      if (stringToLong(argString, &argLong) == EXIT_SUCCESS) {
-        argType = ARGUMENT_TYPE_LONG;
-      } else {
-        argType = ARGUMENT_TYPE_STRING;
-      }
+  // Copy a view into a String, only done when a String setting is changed
+  String strViewToString(StrView view) {
+    String result;
+    result.reserve(view.length);
+    for (size_t i = 0; i < view.length; i++) {
+      result += view.data[i];
     }
-
-    // Return all the things
-    return CommandAndArguments{
-      comChar, argType, argLong, argString, EXIT_SUCCESS
-    };
+    return result;
   }
 
   /** The standard OP for getting/setting/displaying command and args
    * There are two semi identical forms of this function, one where the 
    * argument is a number (long), and one where it is a string
+   * They return EXIT_FAILURE, with a message, for an invalid value. With
+   * 'dryRun' a value is only checked, not set, so a line can be checked
+   * before any of it is applied.
    **/
-  boolean argDisplayOrSetLong(String argName, CommandAndArguments comAndArg, long *var, String *message) {
+  int argDisplayOrSetLong(const char *argName, const CommandAndArguments &comAndArg, long *var, boolean dryRun, String *message) {
     if (comAndArg.argType == ARGUMENT_TYPE_NONE) {
-      *message = argName + " is : " + String(*var);
-      return false;
+      *message = String(argName) + " is : " + String(*var);
+      return EXIT_SUCCESS;
     }
     if (comAndArg.argType == ARGUMENT_TYPE_LONG) {
-      *var = comAndArg.argLong;
-      *message = "Set '" + argName + "' to : " + String(*var);
-      return true;
+      if (!dryRun) {
+        *var = comAndArg.argLong;
+        *message = "Set '" + String(argName) + "' to : " + String(*var);
+      }
+      return EXIT_SUCCESS;
     }
-    return false;
+    *message = "Invalid value for '" + String(argName) + "', expected a whole number";
+    return EXIT_FAILURE;
+  }
+
+  // As argDisplayOrSetLong(), but only sets values from 'min' to 'max'
+  int argDisplayOrSetLongInRange(const char *argName, const CommandAndArguments &comAndArg, long *var, long min, long max, boolean dryRun, String *message) {
+    if (comAndArg.argType == ARGUMENT_TYPE_LONG && (comAndArg.argLong < min || comAndArg.argLong > max)) {
+      *message = "Invalid value for '" + String(argName) + "', expected " + String(min) + " to " + String(max);
+      return EXIT_FAILURE;
+    }
+    return argDisplayOrSetLong(argName, comAndArg, var, dryRun, message);
   }
 
   /** The standard OP for getting/setting/displaying command and args
    * There are two semi identical forms of this function, one where the 
    * argument is a number (long), and one where it is a string
+   * The old single letter form takes the value * denominator as a whole
+   * number, the named form takes the value itself
    **/
-  boolean argDisplayOrSetDoubleFromLong(String argName, CommandAndArguments comAndArg, double *var, uint16_t denominator, String *message) {
+  int argDisplayOrSetDoubleFromLong(const char *argName, const CommandAndArguments &comAndArg, double *var, uint16_t denominator, boolean dryRun, String *message) {
     if (comAndArg.argType == ARGUMENT_TYPE_NONE) {
-      *message = argName + " is : " + String(*var);
-      return false;
+      *message = String(argName) + " is : " + String(*var);
+      return EXIT_SUCCESS;
+    }
+    if (comAndArg.named && (comAndArg.argType == ARGUMENT_TYPE_LONG || comAndArg.argType == ARGUMENT_TYPE_DOUBLE)) {
+      if (!dryRun) {
+        *var = comAndArg.argDouble;
+        *message = "Set '" + String(argName) + "' to : " + String(*var);
+      }
+      return EXIT_SUCCESS;
     }
     if (comAndArg.argType == ARGUMENT_TYPE_LONG) {
-      *var = 1.0 * comAndArg.argLong / denominator;
-      *message = "Set '" + argName + "' to : " + String(*var);
-      return true;
+      if (!dryRun) {
+        *var = 1.0 * comAndArg.argLong / denominator;
+        *message = "Set '" + String(argName) + "' to : " + String(*var);
+      }
+      return EXIT_SUCCESS;
     }
-    return false;
+    *message = "Invalid value for '" + String(argName) + "', expected a number";
+    return EXIT_FAILURE;
   }
 
   // String version
-  boolean argDisplayOrSetString(String argName, CommandAndArguments comAndArg, String *var, String *message) {
+  int argDisplayOrSetString(const char *argName, const CommandAndArguments &comAndArg, String *var, boolean dryRun, String *message) {
     if (comAndArg.argType == ARGUMENT_TYPE_NONE) {
-      *message = argName + " is : '" + *var + "'";
-      return false;
+      *message = String(argName) + " is : '" + *var + "'";
+      return EXIT_SUCCESS;
     }
     if (comAndArg.argType == ARGUMENT_TYPE_STRING) {
-      *var = comAndArg.argString;
-      *message = "Set '" + argName + "' to : '" + *var + "'";
-      return true;
+      if (!dryRun) {
+        *var = strViewToString(comAndArg.argString);
+        *message = "Set '" + String(argName) + "' to : '" + *var + "'";
+      }
+      return EXIT_SUCCESS;
     }
-    return false;
+    *message = "Invalid value for '" + String(argName) + "', expected a string";
+    return EXIT_FAILURE;
   }
   // Boolean version
-  boolean argDisplayOrSetBoolean(String argName, CommandAndArguments comAndArg, boolean *var, String *message) {
+  int argDisplayOrSetBoolean(const char *argName, const CommandAndArguments &comAndArg, boolean *var, boolean dryRun, String *message) {
     if (comAndArg.argType == ARGUMENT_TYPE_NONE) {
-      *message = argName + " is : '" + String(*var) + "'";
-      return false;
+      *message = String(argName) + " is : '" + String(*var) + "'";
+      return EXIT_SUCCESS;
     }
     // Check if true both string and Long
-    comAndArg.argString.toLowerCase();
     if (
         // String and equals 'true'
-        (comAndArg.argType == ARGUMENT_TYPE_STRING && comAndArg.argString == "true") ||
+        (comAndArg.argType == ARGUMENT_TYPE_STRING && strViewEqualsIgnoreCase(comAndArg.argString, "true")) ||
         // Long and equals 1
         (comAndArg.argType == ARGUMENT_TYPE_LONG && comAndArg.argLong == 1)
       ) {
-        *var = true;
-        *message = "Set '" + argName + "' to : 'true'";
-        return true;
+        if (!dryRun) {
+          *var = true;
+          *message = "Set '" + String(argName) + "' to : 'true'";
+        }
+        return EXIT_SUCCESS;
     }
     // Check if false both string and Long
     if (
         // String and equals 'true'
-        (comAndArg.argType == ARGUMENT_TYPE_STRING && comAndArg.argString == "false") ||
+        (comAndArg.argType == ARGUMENT_TYPE_STRING && strViewEqualsIgnoreCase(comAndArg.argString, "false")) ||
         // Long and equals 1
         (comAndArg.argType == ARGUMENT_TYPE_LONG && comAndArg.argLong == 0)
       ) {
-        *var = false;
-        *message = "Set '" + argName + "' to : 'false'";
-        return true;
+        if (!dryRun) {
+          *var = false;
+          *message = "Set '" + String(argName) + "' to : 'false'";
+        }
+        return EXIT_SUCCESS;
     }
-    return false;
+    *message = "Invalid value for '" + String(argName) + "', expected true/false or 1/0";
+    return EXIT_FAILURE;
+  }
+
+/** Time triggered commands
+ * '@' lines are queued in 'commandScheduler' and run from loop() on the
+ * control tick they are due, every command due on a tick before the outputs
+ * are updated, so they take effect together.
+ **/
+CommandScheduler commandScheduler;
+
+String formatTicksAsSeconds(uint32_t ticks) {
+  return String((double)ticks / BOARD.controlTicksPerSecond, 2) + " s";
+}
+
+String formatScheduledCommands(const CommandScheduler &scheduler) {
+  String report = "Now: " + formatTicksAsSeconds(readControlTicks()) +
+    ", " + String(scheduler.count) + "/" + String(SCHEDULER_QUEUE_SIZE) + " scheduled";
+  uint8_t order[SCHEDULER_QUEUE_SIZE];
+  uint8_t count = commandSchedulerOrder(&scheduler, order);
+  for (uint8_t i = 0; i < count; i++) {
+    const ScheduledCommand &entry = scheduler.entries[order[i]];
+    report += "\n  " + String(entry.id) + " at " + formatTicksAsSeconds(entry.executeAtTick) +
+      ": " + entry.line;
   }
+  return report;
+}
 
  /** *do things* based on inputString:
   *   * Update progVars
   *   * Show progVars
   * This function should not change output state, but if vars change
   * the 'stateChange' flag shoudl be set
+  * With 'dryRun' nothing is changed, it only checks the command would work.
+  * Returns EXIT_FAILURE, with a message, if it won't.
   *  
   **/
-  int processCommands(String inputString, ProgramVars *progVars, String *message) {
-    // Parse the 'inputString'
-    CommandAndArguments comArgState = parseCommandArgs(inputString);
-
-    // Exit with message if no command
-    if (comArgState.parseState == EXIT_FAILURE) {
-      *message = "Input string is not a valid command/argument";
-      return EXIT_FAILURE;
-    }
-
-    // Let us process the commands
+  int processCommand(const CommandAndArguments &comArgState, boolean dryRun, ProgramVars *progVars, String *message) {
+    int result = EXIT_SUCCESS;
+    // Only settings change the state, not the actions ('h', 'S', 'X')
+    boolean isSetting = true;
     switch (comArgState.command)
     {
     case 'h':
-      progVars->stateChange = false;
+      isSetting = false;
       *message = String("Help: \n") + 
         String("Commands will return current value if no argument given, and set to value if given\n") +
-        String("'f': PWM frequency in HZ\n") +
-        String("'p': Whether to measure frequency or use frequency set by 'p'\n") +
-        String("'d': PWM duty cycle 0-reolution max (ie 255 for 8 bit)\n") +
-        String("'m': Frequency modifier to apply to measured frequency as percentage\n") +
-        String("'v': Run variable delta programme Enable (1), or disable (0)\n") +
-        String("'r': Rotational gearing ratio * 1000 \n") +
-        String("'l': Enable (1), or disable (0) led\n") +
-        String("'L': Enable (1), or disable (0) logging");
+        String("Either one letter command per line ('d40'), or several 'name=value' settings\n") +
+        String("separated by spaces ('freqDelta=1.5 pwmDuty=40'). Names are in brackets\n") +
+        String("'f': PWM frequency in HZ (setFreq)\n") +
+        String("'p': Whether to measure frequency or use frequency set by 'p' (useSetFreq)\n") +
+        String("'d': PWM duty cycle 0-reolution max (ie 255 for 8 bit) (pwmDuty)\n") +
+        String("'m': Frequency modifier to apply to measured frequency as percentage (freqDelta, as a factor)\n") +
+        String("'v': Run variable delta programme Enable (1), or disable (0) (runVariableDelta)\n") +
+        String("'r': Rotational gearing ratio * 1000 (freqConversionFactor, as a ratio)\n") +
+        String("'l': Enable (1), or disable (0) led (ledEnable)\n") +
+        String("'L': Enable (1), or disable (0) logging (logging)\n") +
+        String("'S': Show rotation statistics, 'Sreset' to clear them (stats)\n") +
+        String("'t': Stall timeout in ms, no edges for this long goes idle (stallTimeoutMs)\n") +
+        String("'i': LED when idle, off (0), on (1) or keep strobing (2) (idleLedMode)\n") +
+        String("'z': Enable (1), or disable (0) light sleep when idle (drops Bluetooth) (idleSleep)\n") +
+        String("'@': '@+2.0 <settings>' runs them 2 s from now, '@90.25 <settings>' at 90.25 s\n") +
+        String("     since boot, all on the same control tick. '@' alone lists pending\n") +
+        String("'X': Cancel scheduled command by id, 'Xall' cancels them all (cancel)");
       break;
     case 'f':
-      progVars->stateChange = argDisplayOrSetLong("useSetFreq", comArgState, &progVars->setFreq, message);
+      result = argDisplayOrSetLong("setFreq", comArgState, &progVars->setFreq, dryRun, message);
       break;
     case 'p':
-      progVars->stateChange = argDisplayOrSetBoolean("useSetFreq", comArgState, &progVars->useSetFreq, message);
+      result = argDisplayOrSetBoolean("useSetFreq", comArgState, &progVars->useSetFreq, dryRun, message);
       break;
     case 'd':
-      progVars->stateChange = argDisplayOrSetLong("pwmDuty", comArgState, &progVars->pwmDutyThou, message);
+      result = argDisplayOrSetLong("pwmDuty", comArgState, &progVars->pwmDutyThou, dryRun, message);
       break;
     case 'm':
-      progVars->stateChange = argDisplayOrSetDoubleFromLong("freqDelta", comArgState, &progVars->freqDelta, 100, message);
+      result = argDisplayOrSetDoubleFromLong("freqDelta", comArgState, &progVars->freqDelta, 100, dryRun, message);
       break;
     case 'v':
-      progVars->stateChange = argDisplayOrSetBoolean("runVariableDelta", comArgState, &progVars->runVariableDelta, message);
+      result = argDisplayOrSetBoolean("runVariableDelta", comArgState, &progVars->runVariableDelta, dryRun, message);
       break;
     case 'r':
-      progVars->stateChange = argDisplayOrSetDoubleFromLong("freqConversionFactor", comArgState, &progVars->freqConversionFactor, 1000, message);
+      result = argDisplayOrSetDoubleFromLong("freqConversionFactor", comArgState, &progVars->freqConversionFactor, 1000, dryRun, message);
       break;
     case 's':
-      progVars->stateChange = argDisplayOrSetString("randomString", comArgState, &progVars->randomString, message);
+      result = argDisplayOrSetString("randomString", comArgState, &progVars->randomString, dryRun, message);
       break;
     case 'l':
-      progVars->stateChange = argDisplayOrSetBoolean("ledEnable", comArgState, &progVars->ledEnable, message);
+      result = argDisplayOrSetBoolean("ledEnable", comArgState, &progVars->ledEnable, dryRun, message);
       break;
     case 'L':
-      progVars->stateChange = argDisplayOrSetBoolean("logging", comArgState, &progVars->logging, message);
+      result = argDisplayOrSetBoolean("logging", comArgState, &progVars->logging, dryRun, message);
+      break;
+    case 'S':
+      isSetting = false;
+      if (comArgState.argType == ARGUMENT_TYPE_NONE) {
+        if (!dryRun) {
+          *message = formatRotationStatsReport(rotationStats);
+        }
+      } else if (strViewEquals(comArgState.argString, "reset")) {
+        if (!dryRun) {
+          rotationStatsReset(&rotationStats);
+          statsEdgesDropped = 0;
+          statsEdgesSkipped = 0;
+          *message = "Reset rotation statistics";
+        }
+      } else {
+        *message = "Unknown 'S' argument, use 'S' or 'Sreset'";
+        result = EXIT_FAILURE;
+      }
+      break;
+    case 't':
+      result = argDisplayOrSetLongInRange("stallTimeoutMs", comArgState, &progVars->stallTimeoutMs,
+        STALL_TIMEOUT_MS_MIN, STALL_TIMEOUT_MS_MAX, dryRun, message);
+      break;
+    case 'i':
+      result = argDisplayOrSetLongInRange("idleLedMode", comArgState, &progVars->idleLedMode,
+        IDLE_LED_OFF, IDLE_LED_STROBE, dryRun, message);
+      break;
+    case 'z':
+      result = argDisplayOrSetBoolean("idleSleep", comArgState, &progVars->idleSleep, dryRun, message);
+      break;
+    case 'X':
+      isSetting = false;
+      // Whether the id is there can only be known when it runs
+      if (comArgState.argType == ARGUMENT_TYPE_LONG &&
+          (dryRun || commandSchedulerCancel(&commandScheduler, comArgState.argLong))) {
+        *message = "Cancelled scheduled command " + String(comArgState.argLong);
+      } else if (comArgState.argType == ARGUMENT_TYPE_STRING && strViewEquals(comArgState.argString, "all")) {
+        if (!dryRun) {
+          *message = "Cancelled " + String(commandScheduler.count) + " scheduled commands";
+          commandSchedulerReset(&commandScheduler);
+        }
+      } else {
+        *message = "No scheduled command to cancel, use 'X<id>' or 'Xall'";
+        result = EXIT_FAILURE;
+      }
       break;
     default:
-      progVars->stateChange = false;
+      isSetting = false;
       *message = "No recognised command";
+      result = EXIT_FAILURE;
       break;
     }
+    if (!dryRun) {
+      progVars->stateChange = isSetting && result == EXIT_SUCCESS && comArgState.argType != ARGUMENT_TYPE_NONE;
+    }
+    return result;
+  }
+
+  /** Dry run every command on 'line'
+   * Returns EXIT_FAILURE with the message for the first one that wouldn't
+   * work, so a line is run or queued whole or not at all.
+   **/
+  int checkCommands(StrView line, ProgramVars *progVars, String *message) {
+    CommandLine commandLine;
+    CommandAndArguments comArgs;
+    StrView key;
+    if (!commandLineBegin(&commandLine, line)) {
+      *message = "Input string is not a valid command/argument";
+      return EXIT_FAILURE;
+    }
+    while (commandLineNext(&commandLine, &comArgs, &key)) {
+      if (comArgs.parseState == EXIT_FAILURE) {
+        *message = "Unknown setting '" + strViewToString(key) + "'";
+        return EXIT_FAILURE;
+      }
+      if (processCommand(comArgs, true, progVars, message) == EXIT_FAILURE) {
+        return EXIT_FAILURE;
+      }
+    }
     return EXIT_SUCCESS;
   }
 
+/** Schedule the commands after '@'
+ * The first token is the time in seconds: '+2.0' is relative to now,
+ * '90.25' is since boot. It is rounded to the nearest control tick. With
+ * no time we list what is pending instead. Every setting on the line is
+ * checked before it is queued, if any is invalid none of it is.
+ **/
+int scheduleCommands(StrView schedule, ProgramVars *progVars, String *message) {
+  CommandTokenizer tokenizer = commandTokenizerBegin(schedule.data, schedule.length);
+  CommandToken timeToken;
+  if (!commandTokenizerNext(&tokenizer, &timeToken)) {
+    *message = formatScheduledCommands(commandScheduler);
+    return EXIT_SUCCESS;
+  }
+
+  double seconds;
+  bool relative = timeToken.key.data[0] == '+';
+  if (timeToken.hasValue || timeToken.key.data[0] == '-' ||
+      !parseDecimalStrict(timeToken.key, &seconds) ||
+      seconds * BOARD.controlTicksPerSecond >= INT32_MAX) {
+    *message = "Invalid schedule time, use '@+<seconds>' or '@<seconds since boot>'";
+    return EXIT_FAILURE;
+  }
+  uint32_t now = readControlTicks();
+  uint32_t ticks = (uint32_t)(seconds * BOARD.controlTicksPerSecond + 0.5);
+  uint32_t executeAt = relative ? now + ticks : ticks;
+  if (!relative && tickBefore(executeAt, now)) {
+    *message = "Schedule time has passed, now is " + formatTicksAsSeconds(now);
+    return EXIT_FAILURE;
+  }
+
+  StrView commands = strViewTrim(strView(tokenizer.position, tokenizer.end - tokenizer.position));
+  if (commands.length == 0) {
+    *message = "Nothing to schedule";
+    return EXIT_FAILURE;
+  }
+  // Check all of it now, a line is queued whole or not at all
+  if (checkCommands(commands, progVars, message) == EXIT_FAILURE) {
+    *message = "Not scheduled: " + *message;
+    return EXIT_FAILURE;
+  }
+  uint32_t id;
+  if (!commandSchedulerAdd(&commandScheduler, executeAt, commands, &id)) {
+    *message = commandScheduler.count >= SCHEDULER_QUEUE_SIZE ?
+      "Schedule is full" : "Scheduled command is too long";
+    return EXIT_FAILURE;
+  }
+  *message = "Scheduled " + String(id) + " at " + formatTicksAsSeconds(executeAt);
+  return EXIT_SUCCESS;
+}
+
+
+ /** Run every command on the line in 'inputString'
+  * The line is read in place with the tokenizer, it is not copied.
+  * A line starting with '@' is scheduled for later rather than run.
+  * If the first token isn't a named setting the whole line is one old style
+  * command, so 'sHello world' still sets randomString to "Hello world" (see
+  * commandLineBegin()).
+  * The whole line is checked first and nothing is set if any of it is
+  * invalid, the same as for '@' lines.
+  * Messages from each setting are joined with newlines, and 'stateChange'
+  * is set if any of them changed something.
+  **/
+  int processCommands(StrView inputLine, ProgramVars *progVars, String *message) {
+    StrView line = strViewTrim(inputLine);
+    if (line.length > 0 && line.data[0] == '@') {
+      progVars->stateChange = false;
+      return scheduleCommands(strView(line.data + 1, line.length - 1), progVars, message);
+    }
+
+    // Exit with message if no command, or any of it is invalid
+    if (checkCommands(line, progVars, message) == EXIT_FAILURE) {
+      *message = "Nothing set: " + *message;
+      progVars->stateChange = false;
+      return EXIT_FAILURE;
+    }
+
+    CommandLine commandLine;
+    CommandAndArguments comArgState;
+    StrView key;
+    commandLineBegin(&commandLine, line);
+
+    int result = EXIT_SUCCESS;
+    boolean stateChange = false;
+    String commandMessage;
+    *message = "";
+    while (commandLineNext(&commandLine, &comArgState, &key)) {
+      if (processCommand(comArgState, false, progVars, &commandMessage) == EXIT_FAILURE) {
+        result = EXIT_FAILURE;
+      }
+      stateChange = stateChange || progVars->stateChange;
+      if (message->length() > 0) {
+        *message += "\n";
+      }
+      *message += commandMessage;
+    }
+
+    progVars->stateChange = stateChange;
+    return result;
+  }
+
+  int processCommands(const String &inputString, ProgramVars *progVars, String *message) {
+    return processCommands(strView(inputString.c_str(), inputString.length()), progVars, message);
+  }
+
 String formatProgVars(long time, ProgramVars progVars) {
   return String(time) + " ledEnable: " + String(progVars.ledEnable) +
     " setFreq: " + String(progVars.setFreq) +
@@ -409,7 +851,7 @@ String formatProgVars(long time, ProgramVars progVars) {
 }
 
 double calculateFinalFrequency(float avgPeriod, double conversionFactor) {
-  double frequencyAtMotor = 1 / (avgPeriod * FREQ_MEASURE_TIMER_PERIOD);
+  double frequencyAtMotor = 1 / (avgPeriod * FREQ_MEASURE_TICK_SECONDS);
   // Apply the conversion factor
   return frequencyAtMotor * conversionFactor;
 }
@@ -501,8 +943,8 @@ void makeShitCoolAgain(uint32_t timestamp, ProgramVars *programVars) {
 
 
 void setup() {
-  // Initialise the serial hardware at baude 115200
-  Serial.begin(115200);
+  // Initialise the serial hardware at the board's baud (115200)
+  Serial.begin(BOARD.serialBaud);
  
   // Initialise the Bluetooth hardware with a name 'ESP32'
   if(!SerialBT.begin("ESP32")){
@@ -510,52 +952,55 @@ void setup() {
   }
 
   // Give a semaphore that we can check in the loop
-  // Setup Timer 1 on interrupt
   // Create semaphore to inform us when the timer has fired
   timerSemaphore = xSemaphoreCreateBinary();
-  // Use 1st timer of 4 (counted from zero).
-  // Set 80 divider for prescaler (see ESP32 Technical Reference Manual for more
-  // info).
-  timer = timerBegin(0, 80, true);
-  // Attach onTimer function to our timer.
-  timerAttachInterrupt(timer, &onTimer, true);
-  // Set alarm to call onTimer function every quarter second (value in microseconds).
-  // Repeat the alarm (third parameter)
-  timerAlarmWrite(timer, 1000000/4, true);
-  // Start an alarm
-  timerAlarmEnable(timer);
+  // Call onTimer every control tick (quarter second). The ticks count from
+  // now, a periodic esp_timer fires on whole periods from its start
+  esp_timer_create_args_t controlTimerArgs = {};
+  controlTimerArgs.callback = &onTimer;
+  controlTimerArgs.name = "control";
+  esp_timer_create(&controlTimerArgs, &controlTimer);
+  controlTickOrigin = esp_timer_get_time();
+  esp_timer_start_periodic(controlTimer, CONTROL_TICK_MICROSECONDS);
 
 
   // Attach an LED thingee
   // configure LED PWM functionalitites
-  // ledcSetup(LED_PWM_CHANNEL, programVars.pwmFreq, LED_PWM_RESOLUTION);
-  ledcSetup(LED_PWM_CHANNEL, 500, LED_PWM_RESOLUTION);
+  ledcSetup(BOARD.ledPwmChannel, BOARD.ledPwmInitialFreq, BOARD.ledPwmResolution);
   // attach the channel to the GPIO to be controlled
-  ledcAttachPin(LED_ONBOARD_PIN, LED_PWM_CHANNEL);
-  ledcAttachPin(LED_PIN, LED_PWM_CHANNEL);
+  ledcAttachPin(BOARD.ledOnboardPin, BOARD.ledPwmChannel);
+  ledcAttachPin(BOARD.ledPin, BOARD.ledPwmChannel);
 
 
   // Setup frequency measure timer
   // sets pin high
-  pinMode(FREQ_MEASURE_PIN, INPUT);
+  pinMode(BOARD.freqMeasurePin, INPUT);
   // attaches pin to interrupt on Falling Edge
-  attachInterrupt(digitalPinToInterrupt(FREQ_MEASURE_PIN), handleFrequencyMeasureInterrupt, FALLING);
-  // Setup the timer
-  fTimer = timerBegin(FREQ_MEASURE_TIMER, FREQ_MEASURE_TIMER_PRESCALAR, FREQ_MEASURE_TIMER_COUNT_UP);
+  attachInterrupt(digitalPinToInterrupt(BOARD.freqMeasurePin), handleFrequencyMeasureInterrupt, FALLING);
+  // Setup the timer, counting up
+  fTimer = timerBegin(BOARD.freqMeasureTimer, BOARD.freqMeasureTimerPrescaler, true);
   // Start the timer
   timerStart(fTimer);
+
+  commandSchedulerReset(&commandScheduler);
 }
  
 void loop() {
  
   // If Timer has fired do some non-realtime stuff
   if (xSemaphoreTake(timerSemaphore, 0) == pdTRUE){
+    // Changes from outside the commands (the rotation state) are kept, and
+    // we note whether a command changed anything, serial or scheduled
+    boolean pendingChange = programVars.stateChange;
+    boolean commandChange = false;
+
     // If the buffers end in newline, try to parse the command an arguments
     if(serialBuffer.endsWith("\n")) {
       // Print out the buffer - for fun
       Serial.println(serialBuffer);
       // Process the commands
       processCommands(serialBuffer, &programVars, &messages);
+      commandChange = programVars.stateChange;
       // Print the message
       Serial.println(messages);
       SerialBT.println(messages);
@@ -563,22 +1008,40 @@ void loop() {
       serialBuffer = "";
     }
 
+    // Run everything scheduled for this tick, as one batch
+    ScheduledCommand dueCommand;
+    uint32_t nowTicks = readControlTicks();
+    while (commandSchedulerPopDue(&commandScheduler, nowTicks, &dueCommand)) {
+      processCommands(strView(dueCommand.line, strlen(dueCommand.line)), &programVars, &messages);
+      commandChange = commandChange || programVars.stateChange;
+      messages = "Ran scheduled " + String(dueCommand.id) + ": " + messages;
+      Serial.println(messages);
+      SerialBT.println(messages);
+    }
+    programVars.stateChange = pendingChange || commandChange;
+
     if (programVars.stateChange == true || fAdded == true) {
       // reset c flhangeag
       fAdded = false;
       programVars.stateChange = false;
 
 
+      // The first frequency after a re-lock replaces one from before the stall
+      boolean firstEstimate = false;
       if (programVars.useSetFreq) {
         programVars.pwmFreq = programVars.setFreq;
-      } else {
+      } else if (ringFill > 0) {
+        firstEstimate = !freqEstimated;
+        freqEstimated = true;
         // calculate the frequency from the average period
+        // After a re-lock the ring is part empty (zeros), so only count what
+        // is there. Otherwise there is nothing to measure, keep the last one
         sumPeriod = 0;
-        for (int i = 0; i < FREQ_MEASUER_SAMPLE_NUM; ++i)
+        for (int i = 0; i < FREQ_SAMPLE_NUM; ++i)
         {
             sumPeriod += myRing[i];
         }
-        avgPeriod = ((float)sumPeriod)/FREQ_MEASUER_SAMPLE_NUM; //or cast sum to double before division
+        avgPeriod = ((float)sumPeriod)/ringFill; //or cast sum to double before division
         programVars.pwmFreq = calculateFinalFrequency(avgPeriod, programVars.freqConversionFactor) * programVars.freqDelta;
       }
 
@@ -588,20 +1051,27 @@ void loop() {
 
       Serial.println(messages);
       SerialBT.println(messages);
-      // We need to change duty to 0 if LED is disabled
-      if (programVars.ledEnable == true) {
-        ledcWrite(LED_PWM_CHANNEL, programVars.pwmDutyThou);
-      } else {
-        messages = "Disabling LED";
-        ledcWrite(LED_PWM_CHANNEL, 0);
+      // If a command changed things, or this is the first frequency since a
+      // re-lock, change the frequency now rather than on the next whole
+      // second, so it lands on the same tick as the duty. Later measurements
+      // wait for the second, rewriting LEDC glitches the LED
+      if ((commandChange || firstEstimate) && programVars.pwmFreq != prevFreq) {
+        if (!writeStrobeFrequency(programVars.pwmFreq, &messages) && messages.length() > 0) {
+          Serial.println(messages);
+          SerialBT.println(messages);
+        }
+        prevFreq = programVars.pwmFreq;
       }
+      // We need to change duty to 0 if LED is disabled, or as set when idle
+      ledcWrite(BOARD.ledPwmChannel, outputDuty(&programVars, rotationState));
     }
 
-    // Timer fires every quarter second, so every four tickes
-    // we increment the timestamp and log
-    if (timestampQuarter%4 == 0) {
-      timestamp++;
-      timestampQuarter = 0;
+    // Timer fires every quarter second, so on the tick that starts a new
+    // second we move the timestamp on and log. The seconds come from the
+    // same clock as '@', so a command at @90 runs in the second logged as 90
+    uint32_t nowSeconds = nowTicks / BOARD.controlTicksPerSecond;
+    if (nowSeconds != timestamp) {
+      timestamp = nowSeconds;
 
       if (programVars.runVariableDelta == true) {
         makeShitCoolAgain(timestamp, &programVars);
@@ -609,18 +1079,19 @@ void loop() {
 
       // Change the PWM freq if it has changed
       if ( programVars.pwmFreq != prevFreq) {
-        ledcWriteTone(LED_PWM_CHANNEL, programVars.pwmFreq);
-        prevFreq = programVars.pwmFreq;
-        if (programVars.ledEnable == true) {
-          ledcWrite(LED_PWM_CHANNEL, programVars.pwmDutyThou);
-        } else {
-          ledcWrite(LED_PWM_CHANNEL, 0);
+        if (!writeStrobeFrequency(programVars.pwmFreq, &messages) && messages.length() > 0) {
+          Serial.println(messages);
+          SerialBT.println(messages);
         }
+        prevFreq = programVars.pwmFreq;
+        ledcWrite(BOARD.ledPwmChannel, outputDuty(&programVars, rotationState));
       }
 
       // print logging info if enabled
       if (programVars.logging == true) {
-        String logMessage = formatProgVars(timestamp, programVars);    
+        String logMessage = formatProgVars(timestamp, programVars) +
+          " state: " + rotationStateName(rotationState) + " " +
+          formatRotationStats(rotationStats);
         Serial.println(logMessage);
         SerialBT.println(logMessage);
       }
@@ -628,6 +1099,18 @@ void loop() {
   }
 
   // Do realtime things
+  // Keep the rotation statistics up to date with every edge
+  updateRotationStats(rotationState);
+
+  // Watch for the motor stopping, and starting again
+  if (updateRotationState(&programVars, &rotationState)) {
+    messages = "Rotation state: " + rotationStateName(rotationState);
+    Serial.println(messages);
+    SerialBT.println(messages);
+    // Puts the LED in, or back from, its idle behaviour
+    programVars.stateChange = true;
+  }
+
   // Calculate the frequency
   // programVars.pwmFreq = programVars.useSetFreq;
   // if (programVars.useSetFreq) {
@@ -652,6 +1135,18 @@ void loop() {
   }
 
 
+  // Nothing to do while idle, so sleep until an edge or the next tick.
+  // Don't sleep on a half read command
+  if (rotationState == ROTATION_STATE_IDLE && programVars.idleSleep == true &&
+      serialBuffer.length() == 0) {
+    if (idleLightSleep() == false) {
+      programVars.idleSleep = false;
+      messages = "Light sleep refused, disabling idleSleep";
+      Serial.println(messages);
+      SerialBT.println(messages);
+    }
+  }
+
   // Wait 50 ms
   // ooooo, gross! Don't do that. naa fk ya
   // delay(50);
@@ -0,0 +1,27 @@
+#include <stdio.h>
+
+/** Host side runner for the 'native' environment
+ * There is no hardware here, so this reports what the selected board
+ * profile works out to, then runs the host benchmarks. Build and run with:
+ *   pio run -e native && .pio/build/native/program
+ **/
+#include "board_profiles.h"
+
+// parser_bench.cpp
+void runParserBenchmark();
+
+int main() {
+  printf("Board profile: %s\n", BOARD.name);
+  printf("Timer tick: %.9f s\n", FREQ_MEASURE_TICK_SECONDS);
+  printf("Max measurable RPM: %.1f (motor max %lu)\n",
+    FREQ_MEASURE_MAX_RPM, (unsigned long)BOARD.motorMaxRpm);
+  printf("LEDC frequency range at %u bits: %.3f Hz to %.1f Hz\n",
+    BOARD.ledPwmResolution, LEDC_MIN_FREQ_HZ, LEDC_MAX_FREQ_HZ);
+  printf("Strobe frequency range for %lu to %lu RPM: %.3f Hz to %.1f Hz\n",
+    (unsigned long)BOARD.motorMinRpm, (unsigned long)BOARD.motorMaxRpm,
+    strobeFreqHz(BOARD, BOARD.motorMinRpm), strobeFreqHz(BOARD, BOARD.motorMaxRpm));
+  printf("Period ring: %u samples, mask 0x%x\n", FREQ_SAMPLE_NUM, FREQ_SAMPLE_MASK);
+  printf("\n");
+  runParserBenchmark();
+  return 0;
+}
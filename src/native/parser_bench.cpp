@@ -0,0 +1,222 @@
+#include <chrono>
+#include <new>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/** Command parser microbenchmark
+ * Compares the old String based parser with the zero copy tokenizer in
+ * include/command_tokenizer.h, reporting commands per second and heap
+ * allocations per command.
+ *
+ * The old parser can't run off the ESP32 as it is, so 'LegacyString' below
+ * stands in for the Arduino String: every copy, substring and temporary is
+ * a heap allocation, as it is on the board. The parse itself is the one
+ * main.cpp used: take the line by value, trim(), charAt(0), substring(1),
+ * toInt() and compare against "0". The new side runs the line parser from
+ * the header, name lookup and argument typing included.
+ **/
+#include "command_tokenizer.h"
+
+// Count every allocation made while a benchmark runs
+static unsigned long allocationCount = 0;
+
+void *operator new(size_t size) {
+  allocationCount++;
+  void *p = malloc(size ? size : 1);
+  if (p == NULL) {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+void operator delete(void *p) noexcept {
+  free(p);
+}
+void operator delete(void *p, size_t) noexcept {
+  free(p);
+}
+void *operator new[](size_t size) {
+  return operator new(size);
+}
+void operator delete[](void *p) noexcept {
+  free(p);
+}
+void operator delete[](void *p, size_t) noexcept {
+  free(p);
+}
+
+// Just enough of the Arduino String for the old parser
+class LegacyString {
+ public:
+  LegacyString(const char *s = "") { set(s, strlen(s)); }
+  LegacyString(const char *s, size_t n) { set(s, n); }
+  LegacyString(const LegacyString &other) { set(other.buffer, other.len); }
+  LegacyString &operator=(const LegacyString &other) {
+    if (this != &other) {
+      delete[] buffer;
+      set(other.buffer, other.len);
+    }
+    return *this;
+  }
+  ~LegacyString() { delete[] buffer; }
+
+  size_t length() const { return len; }
+  char charAt(size_t i) const { return i < len ? buffer[i] : 0; }
+  LegacyString substring(size_t from) const {
+    return from < len ? LegacyString(buffer + from, len - from) : LegacyString();
+  }
+  void trim() {
+    size_t start = 0;
+    size_t end = len;
+    while (start < end && isCommandSpace(buffer[start])) {
+      start++;
+    }
+    while (end > start && isCommandSpace(buffer[end - 1])) {
+      end--;
+    }
+    memmove(buffer, buffer + start, end - start);
+    len = end - start;
+    buffer[len] = '\0';
+  }
+  long toInt() const { return atol(buffer); }
+  bool operator==(const char *s) const { return strcmp(buffer, s) == 0; }
+
+ private:
+  void set(const char *s, size_t n) {
+    buffer = new char[n + 1];
+    memcpy(buffer, s, n);
+    buffer[n] = '\0';
+    len = n;
+  }
+  char  *buffer;
+  size_t len;
+};
+
+/** The old parser, as it was in main.cpp **/
+struct LegacyCommandAndArguments {
+  char         command;
+  int          argType;
+  long         argLong;
+  LegacyString argString;
+  bool         parseState;
+};
+
+int legacyStringToLong(LegacyString inputString, long *targetInt) {
+  int32_t intTemp = inputString.toInt();
+  if (intTemp != 0) {
+    *targetInt = intTemp;
+    return EXIT_SUCCESS;
+  } else if (inputString == "0") {
+    *targetInt = 0;
+    return EXIT_SUCCESS;
+  } else {
+    return EXIT_FAILURE;
+  }
+}
+
+LegacyCommandAndArguments legacyParseCommandArgs(LegacyString commandArgs) {
+  char comChar = 'h';
+  int argType = 0;
+  long argLong = 0;
+  LegacyString argString = "";
+
+  commandArgs.trim();
+  if (commandArgs.length() == 0) {
+    return LegacyCommandAndArguments{comChar, argType, argLong, argString, false};
+  }
+  comChar = commandArgs.charAt(0);
+  if (commandArgs.length() > 1) {
+    argString = commandArgs.substring(1);
+    if (legacyStringToLong(argString, &argLong) == EXIT_SUCCESS) {
+      argType = 1;
+    } else {
+      argType = 3;
+    }
+  }
+  return LegacyCommandAndArguments{comChar, argType, argLong, argString, true};
+}
+
+/** The new parser, the same calls processCommands() makes
+ * commandLineBegin()/commandLineNext() do all of the parsing, main.cpp only
+ * acts on the result, so this times what the firmware runs.
+ **/
+long tokenizerParseLine(const char *line, size_t length) {
+  CommandLine commandLine;
+  CommandAndArguments comArgs;
+  StrView key;
+  long checksum = 0;
+  if (!commandLineBegin(&commandLine, strView(line, length))) {
+    return checksum;
+  }
+  while (commandLineNext(&commandLine, &comArgs, &key)) {
+    checksum += comArgs.command + comArgs.argType + comArgs.argLong +
+      (long)comArgs.argDouble + comArgs.argString.length + key.length;
+  }
+  return checksum;
+}
+
+// Lines a user might send, one command each so both parsers can run them
+static const char *singleCommands[] = {
+  "f500\n", "d40\n", "m150\n", "L1\n", "pfalse\n", "sHello\n", "h\n", "r260\n",
+};
+// Several settings per line, which only the tokenizer understands
+static const char *multiCommands[] = {
+  "freqDelta=1.5 pwmDuty=40\n",
+  "setFreq=500 useSetFreq=true ledEnable=1\n",
+  "randomString=\"hello world\" logging=0\n",
+};
+
+const unsigned long ITERATIONS = 200000;
+
+template <typename ParseLine>
+void runBenchmark(const char *name, size_t lineCount, unsigned commandsPerPass, ParseLine parseLine) {
+  volatile long sink = 0;
+  allocationCount = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (unsigned long i = 0; i < ITERATIONS; i++) {
+    for (size_t l = 0; l < lineCount; l++) {
+      sink = sink + parseLine(l);
+    }
+  }
+  auto stop = std::chrono::steady_clock::now();
+  unsigned long allocations = allocationCount;
+
+  double seconds = std::chrono::duration<double>(stop - start).count();
+  double commands = (double)ITERATIONS * commandsPerPass;
+  printf("%-28s %12.0f commands/s %8.2f allocations/command\n",
+    name, commands / seconds, allocations / commands);
+}
+
+void runParserBenchmark() {
+  const size_t singleCount = sizeof(singleCommands) / sizeof(singleCommands[0]);
+  const size_t multiCount = sizeof(multiCommands) / sizeof(multiCommands[0]);
+  // Settings across all the multi lines: 2 + 3 + 2
+  const unsigned multiSettings = 7;
+
+  // The serial buffer already holds the line, so build these up front
+  LegacyString *serialBuffers[singleCount];
+  for (size_t l = 0; l < singleCount; l++) {
+    serialBuffers[l] = new LegacyString(singleCommands[l]);
+  }
+
+  printf("Command parser benchmark, %lu passes\n", ITERATIONS);
+  runBenchmark("legacy String parser", singleCount, singleCount,
+    [&](size_t l) {
+      // processCommands() took the serial buffer by value, and passed
+      // that on to parseCommandArgs() by value again
+      LegacyString inputString = *serialBuffers[l];
+      return legacyParseCommandArgs(inputString).argLong;
+    });
+  runBenchmark("tokenizer, one per line", singleCount, singleCount,
+    [](size_t l) {
+      return tokenizerParseLine(singleCommands[l], strlen(singleCommands[l]));
+    });
+  runBenchmark("tokenizer, several per line", multiCount, multiSettings,
+    [](size_t l) {
+      return tokenizerParseLine(multiCommands[l], strlen(multiCommands[l]));
+    });
+
+  for (size_t l = 0; l < singleCount; l++) {
+    delete serialBuffers[l];
+  }
+}
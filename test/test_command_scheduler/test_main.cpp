@@ -0,0 +1,163 @@
+#include <string.h>
+#include <unity.h>
+
+#include "command_scheduler.h"
+
+/** Command scheduler tests
+ * Run on the host with 'pio test -e native'.
+ **/
+
+CommandScheduler scheduler;
+
+void setUp(void) {
+  commandSchedulerReset(&scheduler);
+}
+void tearDown(void) {}
+
+uint32_t add(uint32_t tick, const char *line) {
+  uint32_t id = 0;
+  TEST_ASSERT_TRUE(commandSchedulerAdd(&scheduler, tick, strView(line, strlen(line)), &id));
+  return id;
+}
+
+void test_tick_before(void) {
+  TEST_ASSERT_TRUE(tickBefore(1, 2));
+  TEST_ASSERT_FALSE(tickBefore(2, 1));
+  TEST_ASSERT_FALSE(tickBefore(5, 5));
+}
+
+// Just before the counter wraps is still before just after it
+void test_tick_before_wraparound(void) {
+  TEST_ASSERT_TRUE(tickBefore(0xFFFFFFF0UL, 5));
+  TEST_ASSERT_FALSE(tickBefore(5, 0xFFFFFFF0UL));
+  TEST_ASSERT_TRUE(tickBefore(0xFFFFFFFFUL, 0));
+}
+
+void test_pops_in_tick_order(void) {
+  const uint32_t ticks[] = {50, 10, 40, 20, 30, 60, 0, 70};
+  for (uint8_t i = 0; i < sizeof(ticks) / sizeof(ticks[0]); i++) {
+    add(ticks[i], "f500");
+  }
+
+  ScheduledCommand due;
+  uint32_t lastTick = 0;
+  uint8_t popped = 0;
+  while (commandSchedulerPopDue(&scheduler, 100, &due)) {
+    TEST_ASSERT_FALSE(tickBefore(due.executeAtTick, lastTick));
+    lastTick = due.executeAtTick;
+    popped++;
+  }
+  TEST_ASSERT_EQUAL(8, popped);
+  TEST_ASSERT_EQUAL(0, scheduler.count);
+}
+
+void test_only_pops_due(void) {
+  add(10, "d40");
+  add(20, "d50");
+
+  ScheduledCommand due;
+  TEST_ASSERT_FALSE(commandSchedulerPopDue(&scheduler, 9, &due));
+  TEST_ASSERT_TRUE(commandSchedulerPopDue(&scheduler, 15, &due));
+  TEST_ASSERT_EQUAL_STRING("d40", due.line);
+  TEST_ASSERT_FALSE(commandSchedulerPopDue(&scheduler, 15, &due));
+  TEST_ASSERT_TRUE(commandSchedulerPopDue(&scheduler, 20, &due));
+  TEST_ASSERT_EQUAL_STRING("d50", due.line);
+}
+
+// Commands for the same tick run in the order they were sent
+void test_same_tick_keeps_order(void) {
+  add(30, "later");
+  add(10, "first");
+  add(10, "second");
+  add(10, "third");
+
+  ScheduledCommand due;
+  TEST_ASSERT_TRUE(commandSchedulerPopDue(&scheduler, 30, &due));
+  TEST_ASSERT_EQUAL_STRING("first", due.line);
+  TEST_ASSERT_TRUE(commandSchedulerPopDue(&scheduler, 30, &due));
+  TEST_ASSERT_EQUAL_STRING("second", due.line);
+  TEST_ASSERT_TRUE(commandSchedulerPopDue(&scheduler, 30, &due));
+  TEST_ASSERT_EQUAL_STRING("third", due.line);
+  TEST_ASSERT_TRUE(commandSchedulerPopDue(&scheduler, 30, &due));
+  TEST_ASSERT_EQUAL_STRING("later", due.line);
+}
+
+void test_order_lists_in_run_order(void) {
+  add(30, "c");
+  add(10, "a");
+  add(20, "b");
+  add(10, "a2");
+
+  uint8_t order[SCHEDULER_QUEUE_SIZE];
+  TEST_ASSERT_EQUAL(4, commandSchedulerOrder(&scheduler, order));
+  TEST_ASSERT_EQUAL_STRING("a", scheduler.entries[order[0]].line);
+  TEST_ASSERT_EQUAL_STRING("a2", scheduler.entries[order[1]].line);
+  TEST_ASSERT_EQUAL_STRING("b", scheduler.entries[order[2]].line);
+  TEST_ASSERT_EQUAL_STRING("c", scheduler.entries[order[3]].line);
+}
+
+// Cancelling an entry that isn't the root or last still leaves a heap
+void test_cancel_from_middle(void) {
+  uint32_t ids[7];
+  const uint32_t ticks[] = {10, 20, 30, 40, 50, 60, 70};
+  for (uint8_t i = 0; i < 7; i++) {
+    ids[i] = add(ticks[i], "f500");
+  }
+  // Added in order, so tick 20 is entry 1, an inner node with children
+  TEST_ASSERT_EQUAL(ids[1], scheduler.entries[1].id);
+  TEST_ASSERT_TRUE(commandSchedulerCancel(&scheduler, ids[1]));
+  TEST_ASSERT_TRUE(commandSchedulerCancel(&scheduler, ids[4]));
+  TEST_ASSERT_FALSE(commandSchedulerCancel(&scheduler, ids[1]));
+  TEST_ASSERT_EQUAL(5, scheduler.count);
+
+  const uint32_t expected[] = {10, 30, 40, 60, 70};
+  ScheduledCommand due;
+  for (uint8_t i = 0; i < 5; i++) {
+    TEST_ASSERT_TRUE(commandSchedulerPopDue(&scheduler, 100, &due));
+    TEST_ASSERT_EQUAL_UINT32(expected[i], due.executeAtTick);
+  }
+  TEST_ASSERT_FALSE(commandSchedulerPopDue(&scheduler, 100, &due));
+}
+
+// Entries either side of the counter wrapping still run in time order
+void test_pops_across_wraparound(void) {
+  add(5, "after");
+  add(0xFFFFFFF0UL, "before");
+
+  ScheduledCommand due;
+  TEST_ASSERT_FALSE(commandSchedulerPopDue(&scheduler, 0xFFFFFFEFUL, &due));
+  TEST_ASSERT_TRUE(commandSchedulerPopDue(&scheduler, 0xFFFFFFF0UL, &due));
+  TEST_ASSERT_EQUAL_STRING("before", due.line);
+  TEST_ASSERT_FALSE(commandSchedulerPopDue(&scheduler, 0xFFFFFFFFUL, &due));
+  TEST_ASSERT_TRUE(commandSchedulerPopDue(&scheduler, 5, &due));
+  TEST_ASSERT_EQUAL_STRING("after", due.line);
+}
+
+void test_full_and_too_long(void) {
+  uint32_t id;
+  for (uint8_t i = 0; i < SCHEDULER_QUEUE_SIZE; i++) {
+    add(i, "f500");
+  }
+  TEST_ASSERT_FALSE(commandSchedulerAdd(&scheduler, 0, strView("f500", 4), &id));
+
+  commandSchedulerReset(&scheduler);
+  char line[SCHEDULER_LINE_LENGTH];
+  memset(line, 's', sizeof(line));
+  TEST_ASSERT_FALSE(commandSchedulerAdd(&scheduler, 0, strView(line, SCHEDULER_LINE_LENGTH), &id));
+  TEST_ASSERT_TRUE(commandSchedulerAdd(&scheduler, 0, strView(line, SCHEDULER_LINE_LENGTH - 1), &id));
+  TEST_ASSERT_EQUAL(SCHEDULER_LINE_LENGTH - 1, strlen(scheduler.entries[0].line));
+}
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_tick_before);
+  RUN_TEST(test_tick_before_wraparound);
+  RUN_TEST(test_pops_in_tick_order);
+  RUN_TEST(test_only_pops_due);
+  RUN_TEST(test_same_tick_keeps_order);
+  RUN_TEST(test_order_lists_in_run_order);
+  RUN_TEST(test_cancel_from_middle);
+  RUN_TEST(test_pops_across_wraparound);
+  RUN_TEST(test_full_and_too_long);
+  return UNITY_END();
+}
@@ -0,0 +1,266 @@
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <unity.h>
+
+#include "command_tokenizer.h"
+
+/** Command tokenizer tests
+ * Run on the host with 'pio test -e native'.
+ **/
+
+void setUp(void) {}
+void tearDown(void) {}
+
+StrView view(const char *s) {
+  return strView(s, strlen(s));
+}
+
+void assertViewEquals(const char *expected, StrView actual) {
+  TEST_ASSERT_EQUAL_UINT(strlen(expected), actual.length);
+  TEST_ASSERT_EQUAL_MEMORY(expected, actual.data, actual.length);
+}
+
+void test_parse_long_accepts_whole_numbers(void) {
+  long value = 0;
+  TEST_ASSERT_TRUE(parseLongStrict(view("0"), &value));
+  TEST_ASSERT_EQUAL(0, value);
+  TEST_ASSERT_TRUE(parseLongStrict(view("500"), &value));
+  TEST_ASSERT_EQUAL(500, value);
+  TEST_ASSERT_TRUE(parseLongStrict(view("-42"), &value));
+  TEST_ASSERT_EQUAL(-42, value);
+  TEST_ASSERT_TRUE(parseLongStrict(view("+7"), &value));
+  TEST_ASSERT_EQUAL(7, value);
+}
+
+void test_parse_long_rejects_trailing_junk(void) {
+  long value = 99;
+  TEST_ASSERT_FALSE(parseLongStrict(view("12abc"), &value));
+  TEST_ASSERT_FALSE(parseLongStrict(view("1.5"), &value));
+  TEST_ASSERT_FALSE(parseLongStrict(view(""), &value));
+  TEST_ASSERT_FALSE(parseLongStrict(view("+"), &value));
+  TEST_ASSERT_FALSE(parseLongStrict(view("-"), &value));
+  TEST_ASSERT_EQUAL(99, value);
+}
+
+// long is 32 bits on the ESP32 and usually 64 on the host, so build the
+// limits as strings rather than hard coding them
+void test_parse_long_limits(void) {
+  char text[32];
+  long value = 0;
+
+  snprintf(text, sizeof(text), "%ld", LONG_MIN);
+  TEST_ASSERT_TRUE(parseLongStrict(view(text), &value));
+  TEST_ASSERT_TRUE(value == LONG_MIN);
+
+  snprintf(text, sizeof(text), "%ld", LONG_MAX);
+  TEST_ASSERT_TRUE(parseLongStrict(view(text), &value));
+  TEST_ASSERT_TRUE(value == LONG_MAX);
+}
+
+void test_parse_long_rejects_overflow(void) {
+  char text[32];
+  long value = 99;
+
+  // LONG_MAX ends in 7 and LONG_MIN in 8, one more is out of range
+  snprintf(text, sizeof(text), "%ld", LONG_MAX);
+  text[strlen(text) - 1]++;
+  TEST_ASSERT_FALSE(parseLongStrict(view(text), &value));
+
+  snprintf(text, sizeof(text), "%ld", LONG_MIN);
+  text[strlen(text) - 1]++;
+  TEST_ASSERT_FALSE(parseLongStrict(view(text), &value));
+
+  // Or a digit longer
+  snprintf(text, sizeof(text), "%ld0", LONG_MAX);
+  TEST_ASSERT_FALSE(parseLongStrict(view(text), &value));
+  TEST_ASSERT_EQUAL(99, value);
+}
+
+void test_parse_decimal(void) {
+  double value = 0;
+  TEST_ASSERT_TRUE(parseDecimalStrict(view("1.5"), &value));
+  TEST_ASSERT_EQUAL_DOUBLE(1.5, value);
+  TEST_ASSERT_TRUE(parseDecimalStrict(view(".5"), &value));
+  TEST_ASSERT_EQUAL_DOUBLE(0.5, value);
+  TEST_ASSERT_TRUE(parseDecimalStrict(view("1."), &value));
+  TEST_ASSERT_EQUAL_DOUBLE(1.0, value);
+  TEST_ASSERT_TRUE(parseDecimalStrict(view("-2.25"), &value));
+  TEST_ASSERT_EQUAL_DOUBLE(-2.25, value);
+}
+
+void test_parse_decimal_rejects(void) {
+  double value = 99;
+  TEST_ASSERT_FALSE(parseDecimalStrict(view(""), &value));
+  TEST_ASSERT_FALSE(parseDecimalStrict(view("+"), &value));
+  TEST_ASSERT_FALSE(parseDecimalStrict(view("."), &value));
+  TEST_ASSERT_FALSE(parseDecimalStrict(view("-."), &value));
+  TEST_ASSERT_FALSE(parseDecimalStrict(view("1e3"), &value));
+  TEST_ASSERT_FALSE(parseDecimalStrict(view("1.2.3"), &value));
+  TEST_ASSERT_FALSE(parseDecimalStrict(view("nan"), &value));
+  TEST_ASSERT_EQUAL_DOUBLE(99, value);
+}
+
+void test_tokenizer_separators(void) {
+  const char *line = " freqDelta=1.5,pwmDuty=40; \tlogging ";
+  CommandTokenizer tokenizer = commandTokenizerBegin(line, strlen(line));
+  CommandToken token;
+
+  TEST_ASSERT_TRUE(commandTokenizerNext(&tokenizer, &token));
+  assertViewEquals("freqDelta", token.key);
+  TEST_ASSERT_TRUE(token.hasValue);
+  assertViewEquals("1.5", token.value);
+
+  TEST_ASSERT_TRUE(commandTokenizerNext(&tokenizer, &token));
+  assertViewEquals("pwmDuty", token.key);
+  assertViewEquals("40", token.value);
+
+  TEST_ASSERT_TRUE(commandTokenizerNext(&tokenizer, &token));
+  assertViewEquals("logging", token.key);
+  TEST_ASSERT_FALSE(token.hasValue);
+
+  TEST_ASSERT_FALSE(commandTokenizerNext(&tokenizer, &token));
+}
+
+void test_tokenizer_empty_value(void) {
+  const char *line = "pwmDuty= logging=";
+  CommandTokenizer tokenizer = commandTokenizerBegin(line, strlen(line));
+  CommandToken token;
+
+  TEST_ASSERT_TRUE(commandTokenizerNext(&tokenizer, &token));
+  assertViewEquals("pwmDuty", token.key);
+  TEST_ASSERT_TRUE(token.hasValue);
+  TEST_ASSERT_EQUAL_UINT(0, token.value.length);
+
+  TEST_ASSERT_TRUE(commandTokenizerNext(&tokenizer, &token));
+  assertViewEquals("logging", token.key);
+  TEST_ASSERT_TRUE(token.hasValue);
+  TEST_ASSERT_EQUAL_UINT(0, token.value.length);
+
+  TEST_ASSERT_FALSE(commandTokenizerNext(&tokenizer, &token));
+}
+
+void test_tokenizer_quoted_value(void) {
+  const char *line = "randomString=\"hello, world\" logging=0";
+  CommandTokenizer tokenizer = commandTokenizerBegin(line, strlen(line));
+  CommandToken token;
+
+  TEST_ASSERT_TRUE(commandTokenizerNext(&tokenizer, &token));
+  assertViewEquals("hello, world", token.value);
+  TEST_ASSERT_TRUE(commandTokenizerNext(&tokenizer, &token));
+  assertViewEquals("logging", token.key);
+  assertViewEquals("0", token.value);
+  TEST_ASSERT_FALSE(commandTokenizerNext(&tokenizer, &token));
+}
+
+// An unterminated quote runs to the end of the line
+void test_tokenizer_unterminated_quote(void) {
+  const char *line = "randomString=\"hello world; logging=0";
+  CommandTokenizer tokenizer = commandTokenizerBegin(line, strlen(line));
+  CommandToken token;
+
+  TEST_ASSERT_TRUE(commandTokenizerNext(&tokenizer, &token));
+  assertViewEquals("randomString", token.key);
+  assertViewEquals("hello world; logging=0", token.value);
+  TEST_ASSERT_FALSE(commandTokenizerNext(&tokenizer, &token));
+}
+
+void test_command_line_named(void) {
+  CommandLine commandLine;
+  CommandAndArguments comArgs;
+  StrView key;
+
+  TEST_ASSERT_TRUE(commandLineBegin(&commandLine, view("freqDelta=1.5 pwmDuty=40 stats")));
+
+  TEST_ASSERT_TRUE(commandLineNext(&commandLine, &comArgs, &key));
+  TEST_ASSERT_EQUAL_CHAR('m', comArgs.command);
+  TEST_ASSERT_EQUAL(ARGUMENT_TYPE_DOUBLE, comArgs.argType);
+  TEST_ASSERT_EQUAL_DOUBLE(1.5, comArgs.argDouble);
+
+  TEST_ASSERT_TRUE(commandLineNext(&commandLine, &comArgs, &key));
+  TEST_ASSERT_EQUAL_CHAR('d', comArgs.command);
+  TEST_ASSERT_EQUAL(ARGUMENT_TYPE_LONG, comArgs.argType);
+  TEST_ASSERT_EQUAL(40, comArgs.argLong);
+
+  TEST_ASSERT_TRUE(commandLineNext(&commandLine, &comArgs, &key));
+  TEST_ASSERT_EQUAL_CHAR('S', comArgs.command);
+  TEST_ASSERT_EQUAL(ARGUMENT_TYPE_NONE, comArgs.argType);
+
+  TEST_ASSERT_FALSE(commandLineNext(&commandLine, &comArgs, &key));
+}
+
+void test_command_line_unknown_setting(void) {
+  CommandLine commandLine;
+  CommandAndArguments comArgs;
+  StrView key;
+
+  TEST_ASSERT_TRUE(commandLineBegin(&commandLine, view("pwmDuty=40 bogus=1")));
+  TEST_ASSERT_TRUE(commandLineNext(&commandLine, &comArgs, &key));
+  TEST_ASSERT_EQUAL(EXIT_SUCCESS, comArgs.parseState);
+  TEST_ASSERT_TRUE(commandLineNext(&commandLine, &comArgs, &key));
+  TEST_ASSERT_EQUAL(EXIT_FAILURE, comArgs.parseState);
+  assertViewEquals("bogus", key);
+}
+
+void test_command_line_legacy(void) {
+  CommandLine commandLine;
+  CommandAndArguments comArgs;
+  StrView key;
+
+  TEST_ASSERT_TRUE(commandLineBegin(&commandLine, view("f500\r\n")));
+  TEST_ASSERT_TRUE(commandLineNext(&commandLine, &comArgs, &key));
+  TEST_ASSERT_EQUAL_CHAR('f', comArgs.command);
+  TEST_ASSERT_EQUAL(ARGUMENT_TYPE_LONG, comArgs.argType);
+  TEST_ASSERT_EQUAL(500, comArgs.argLong);
+  TEST_ASSERT_FALSE(comArgs.named);
+  TEST_ASSERT_FALSE(commandLineNext(&commandLine, &comArgs, &key));
+
+  // Decimals are only for named settings
+  TEST_ASSERT_TRUE(commandLineBegin(&commandLine, view("m1.5")));
+  TEST_ASSERT_TRUE(commandLineNext(&commandLine, &comArgs, &key));
+  TEST_ASSERT_EQUAL(ARGUMENT_TYPE_STRING, comArgs.argType);
+}
+
+// Not a command name, so the whole line is 's' with the rest as the string
+void test_command_line_legacy_string_with_equals(void) {
+  CommandLine commandLine;
+  CommandAndArguments comArgs;
+  StrView key;
+
+  TEST_ASSERT_TRUE(commandLineBegin(&commandLine, view("sHello=world")));
+  TEST_ASSERT_TRUE(commandLineNext(&commandLine, &comArgs, &key));
+  TEST_ASSERT_EQUAL(EXIT_SUCCESS, comArgs.parseState);
+  TEST_ASSERT_EQUAL_CHAR('s', comArgs.command);
+  TEST_ASSERT_EQUAL(ARGUMENT_TYPE_STRING, comArgs.argType);
+  assertViewEquals("Hello=world", comArgs.argString);
+  TEST_ASSERT_FALSE(commandLineNext(&commandLine, &comArgs, &key));
+}
+
+void test_command_line_empty(void) {
+  CommandLine commandLine;
+  CommandAndArguments comArgs;
+  StrView key;
+
+  TEST_ASSERT_FALSE(commandLineBegin(&commandLine, view(" \r\n")));
+  TEST_ASSERT_FALSE(commandLineNext(&commandLine, &comArgs, &key));
+}
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_parse_long_accepts_whole_numbers);
+  RUN_TEST(test_parse_long_rejects_trailing_junk);
+  RUN_TEST(test_parse_long_limits);
+  RUN_TEST(test_parse_long_rejects_overflow);
+  RUN_TEST(test_parse_decimal);
+  RUN_TEST(test_parse_decimal_rejects);
+  RUN_TEST(test_tokenizer_separators);
+  RUN_TEST(test_tokenizer_empty_value);
+  RUN_TEST(test_tokenizer_quoted_value);
+  RUN_TEST(test_tokenizer_unterminated_quote);
+  RUN_TEST(test_command_line_named);
+  RUN_TEST(test_command_line_unknown_setting);
+  RUN_TEST(test_command_line_legacy);
+  RUN_TEST(test_command_line_legacy_string_with_equals);
+  RUN_TEST(test_command_line_empty);
+  return UNITY_END();
+}
@@ -0,0 +1,179 @@
+#include <unity.h>
+
+#include "rotation_stats.h"
+
+/** Rotation statistics tests
+ * Run on the host with 'pio test -e native'. The native profile has 1us
+ * timer ticks and one pulse per revolution, so a period of 60000 ticks is
+ * 1000 RPM, and 50 RPM histogram bins.
+ **/
+
+RotationStats stats;
+
+void setUp(void) {
+  rotationStatsReset(&stats);
+}
+void tearDown(void) {}
+
+// Period in ticks for 'rpm'
+uint64_t rpmPeriod(double rpm) {
+  return (uint64_t)(60.0 / (rpm * FREQ_MEASURE_TICK_SECONDS * BOARD.pulsesPerRevolution) + 0.5);
+}
+
+void addPeriods(uint64_t period, uint16_t count) {
+  for (uint16_t i = 0; i < count; i++) {
+    rotationStatsAddPeriod(&stats, period);
+  }
+}
+
+void test_period_to_rpm(void) {
+  TEST_ASSERT_EQUAL_DOUBLE(1000.0, periodTicksToRpm(60000));
+  TEST_ASSERT_EQUAL_DOUBLE(0.0, periodTicksToRpm(0));
+}
+
+void test_histogram_bins(void) {
+  TEST_ASSERT_EQUAL_UINT8(0, rpmToHistogramBin(0));
+  TEST_ASSERT_EQUAL_UINT8(20, rpmToHistogramBin(1000));
+  TEST_ASSERT_EQUAL_UINT8(20, rpmToHistogramBin(1049.9));
+  // At and above motorMaxRpm everything goes in the last bin
+  TEST_ASSERT_EQUAL_UINT8(STATS_HISTOGRAM_BINS - 1, rpmToHistogramBin(BOARD.motorMaxRpm - 1));
+  TEST_ASSERT_EQUAL_UINT8(STATS_HISTOGRAM_BINS - 1, rpmToHistogramBin(BOARD.motorMaxRpm));
+  TEST_ASSERT_EQUAL_UINT8(STATS_HISTOGRAM_BINS - 1, rpmToHistogramBin(100000));
+}
+
+void test_single_period(void) {
+  rotationStatsAddPeriod(&stats, 60000);
+  TEST_ASSERT_EQUAL(1, stats.count);
+  TEST_ASSERT_EQUAL_DOUBLE(60000, stats.meanPeriod);
+  TEST_ASSERT_EQUAL_DOUBLE(0, rotationStatsPeriodStdDev(&stats));
+  TEST_ASSERT_EQUAL_DOUBLE(0, rotationStatsJitterRms(&stats));
+  TEST_ASSERT_EQUAL(60000, stats.minPeriod);
+  TEST_ASSERT_EQUAL(60000, stats.maxPeriod);
+}
+
+void test_mean_and_std_dev(void) {
+  rotationStatsAddPeriod(&stats, 20000);
+  rotationStatsAddPeriod(&stats, 30000);
+  rotationStatsAddPeriod(&stats, 40000);
+  TEST_ASSERT_EQUAL_DOUBLE(30000, stats.meanPeriod);
+  // Sample standard deviation of 20000, 30000, 40000
+  TEST_ASSERT_EQUAL_DOUBLE(10000, rotationStatsPeriodStdDev(&stats));
+  TEST_ASSERT_EQUAL(20000, stats.minPeriod);
+  TEST_ASSERT_EQUAL(40000, stats.maxPeriod);
+}
+
+// Welford doesn't lose the variance of a small change on a big period
+void test_std_dev_large_offset(void) {
+  const uint64_t base = 1000000000ULL;
+  rotationStatsAddPeriod(&stats, base + 4);
+  rotationStatsAddPeriod(&stats, base + 7);
+  rotationStatsAddPeriod(&stats, base + 13);
+  rotationStatsAddPeriod(&stats, base + 16);
+  // Variance of 4, 7, 13, 16 is 30
+  TEST_ASSERT_DOUBLE_WITHIN(1e-9, sqrt(30.0), rotationStatsPeriodStdDev(&stats));
+}
+
+void test_jitter(void) {
+  rotationStatsAddPeriod(&stats, 60000);
+  rotationStatsAddPeriod(&stats, 60010);
+  rotationStatsAddPeriod(&stats, 60000);
+  rotationStatsAddPeriod(&stats, 60030);
+  // Changes of 10, 10 and 30
+  TEST_ASSERT_EQUAL(30, stats.jitterMax);
+  TEST_ASSERT_DOUBLE_WITHIN(1e-9, sqrt((100.0 + 100.0 + 900.0) / 3), rotationStatsJitterRms(&stats));
+}
+
+// After a break the next period isn't compared with the one before it
+void test_break_chain(void) {
+  rotationStatsAddPeriod(&stats, 60000);
+  rotationStatsAddPeriod(&stats, 60010);
+  rotationStatsBreakChain(&stats);
+  rotationStatsAddPeriod(&stats, 90000);
+  rotationStatsAddPeriod(&stats, 90005);
+  // Changes of 10 and 5, not the 29990 across the break
+  TEST_ASSERT_EQUAL(10, stats.jitterMax);
+  TEST_ASSERT_EQUAL(2, stats.jitterCount);
+  TEST_ASSERT_DOUBLE_WITHIN(1e-9, sqrt((100.0 + 25.0) / 2), rotationStatsJitterRms(&stats));
+  // Everything else still counts every period
+  TEST_ASSERT_EQUAL(4, stats.count);
+  TEST_ASSERT_EQUAL(90005, stats.maxPeriod);
+}
+
+void test_percentile_empty(void) {
+  TEST_ASSERT_EQUAL_DOUBLE(0, rotationStatsWindowPercentileRpm(&stats, 50));
+}
+
+// Within a bin the percentile is interpolated across the bin
+void test_percentiles_one_bin(void) {
+  addPeriods(rpmPeriod(1000), 100);
+  TEST_ASSERT_EQUAL_DOUBLE(1000, rotationStatsWindowPercentileRpm(&stats, 0));
+  TEST_ASSERT_EQUAL_DOUBLE(1025, rotationStatsWindowPercentileRpm(&stats, 50));
+  TEST_ASSERT_EQUAL_DOUBLE(1050, rotationStatsWindowPercentileRpm(&stats, 100));
+}
+
+void test_percentiles_two_bins(void) {
+  addPeriods(rpmPeriod(1000), 100);
+  addPeriods(rpmPeriod(2000), 100);
+  TEST_ASSERT_EQUAL_DOUBLE(1000, rotationStatsWindowPercentileRpm(&stats, 0));
+  TEST_ASSERT_EQUAL_DOUBLE(1050, rotationStatsWindowPercentileRpm(&stats, 50));
+  TEST_ASSERT_EQUAL_DOUBLE(2025, rotationStatsWindowPercentileRpm(&stats, 75));
+  TEST_ASSERT_EQUAL_DOUBLE(2050, rotationStatsWindowPercentileRpm(&stats, 100));
+}
+
+// Fast enough to be in the last bin, the percentile tops out at its edge
+void test_percentile_last_bin(void) {
+  addPeriods(rpmPeriod(BOARD.motorMaxRpm * 2), 10);
+  TEST_ASSERT_EQUAL_DOUBLE(STATS_HISTOGRAM_BINS * STATS_HISTOGRAM_BIN_RPM,
+    rotationStatsWindowPercentileRpm(&stats, 100));
+}
+
+// Once full, each new edge pushes the oldest out of the window
+void test_window_wraps(void) {
+  addPeriods(rpmPeriod(1000), STATS_WINDOW_SIZE);
+  TEST_ASSERT_EQUAL(STATS_WINDOW_SIZE, stats.windowFill);
+  TEST_ASSERT_EQUAL(0, stats.windowIndex);
+  TEST_ASSERT_EQUAL(STATS_WINDOW_SIZE, stats.windowCounts[20]);
+
+  addPeriods(rpmPeriod(2000), STATS_WINDOW_SIZE / 2);
+  TEST_ASSERT_EQUAL(STATS_WINDOW_SIZE, stats.windowFill);
+  TEST_ASSERT_EQUAL(STATS_WINDOW_SIZE / 2, stats.windowCounts[20]);
+  TEST_ASSERT_EQUAL(STATS_WINDOW_SIZE / 2, stats.windowCounts[40]);
+  TEST_ASSERT_EQUAL_DOUBLE(1050, rotationStatsWindowPercentileRpm(&stats, 50));
+
+  addPeriods(rpmPeriod(2000), STATS_WINDOW_SIZE / 2);
+  TEST_ASSERT_EQUAL(0, stats.windowCounts[20]);
+  TEST_ASSERT_EQUAL(STATS_WINDOW_SIZE, stats.windowCounts[40]);
+  TEST_ASSERT_EQUAL_DOUBLE(2000, rotationStatsWindowPercentileRpm(&stats, 0));
+
+  // The lifetime histogram keeps everything
+  TEST_ASSERT_EQUAL(STATS_WINDOW_SIZE, stats.histogram[20]);
+  TEST_ASSERT_EQUAL(STATS_WINDOW_SIZE, stats.histogram[40]);
+  TEST_ASSERT_EQUAL(2 * STATS_WINDOW_SIZE, stats.count);
+}
+
+void test_reset(void) {
+  addPeriods(rpmPeriod(1000), 10);
+  rotationStatsReset(&stats);
+  TEST_ASSERT_EQUAL(0, stats.count);
+  TEST_ASSERT_EQUAL(0, stats.windowFill);
+  TEST_ASSERT_EQUAL(0, stats.windowCounts[20]);
+  TEST_ASSERT_EQUAL(0, stats.histogram[20]);
+}
+
+int main(int argc, char **argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_period_to_rpm);
+  RUN_TEST(test_histogram_bins);
+  RUN_TEST(test_single_period);
+  RUN_TEST(test_mean_and_std_dev);
+  RUN_TEST(test_std_dev_large_offset);
+  RUN_TEST(test_jitter);
+  RUN_TEST(test_break_chain);
+  RUN_TEST(test_percentile_empty);
+  RUN_TEST(test_percentiles_one_bin);
+  RUN_TEST(test_percentiles_two_bins);
+  RUN_TEST(test_percentile_last_bin);
+  RUN_TEST(test_window_wraps);
+  RUN_TEST(test_reset);
+  return UNITY_END();
+}